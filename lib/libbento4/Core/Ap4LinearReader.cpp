@@ -50,7 +50,8 @@ AP4_LinearReader::AP4_LinearReader(AP4_Movie&      movie,
     m_BufferFullness(0),
     m_BufferFullnessPeak(0),
     m_MaxBufferFullness(max_buffer),
-    m_Mfra(NULL)
+    m_Mfra(NULL),
+    m_FreeSampleBuffers(NULL)
 {
     m_HasFragments = movie.HasFragments();
     if (fragment_stream) {
@@ -65,13 +66,48 @@ AP4_LinearReader::AP4_LinearReader(AP4_Movie&      movie,
 AP4_LinearReader::~AP4_LinearReader()
 {
     for (unsigned int i=0; i<m_Trackers.ItemCount(); i++) {
+        FlushQueue(m_Trackers[i]);
+        if (m_Trackers[i]->m_NextSample) {
+            ReleaseSampleBuffer(m_Trackers[i]->m_NextSample);
+        }
         delete m_Trackers[i];
     }
+    while (m_FreeSampleBuffers) {
+        SampleBuffer* buffer = m_FreeSampleBuffers;
+        m_FreeSampleBuffers = buffer->m_NextFree;
+        delete buffer;
+    }
     delete m_Fragment;
     delete m_Mfra;
     if (m_FragmentStream) m_FragmentStream->Release();
 }
 
+/*----------------------------------------------------------------------
+|   AP4_LinearReader::AcquireSampleBuffer
++---------------------------------------------------------------------*/
+AP4_LinearReader::SampleBuffer*
+AP4_LinearReader::AcquireSampleBuffer()
+{
+    SampleBuffer* buffer = m_FreeSampleBuffers;
+    if (buffer == NULL) return new SampleBuffer();
+    m_FreeSampleBuffers = buffer->m_NextFree;
+    buffer->m_NextFree = NULL;
+    return buffer;
+}
+
+/*----------------------------------------------------------------------
+|   AP4_LinearReader::ReleaseSampleBuffer
++---------------------------------------------------------------------*/
+void
+AP4_LinearReader::ReleaseSampleBuffer(SampleBuffer* buffer)
+{
+    // drop the data stream reference, but keep the memory
+    buffer->m_Sample.Reset();
+    buffer->m_Data.SetDataSize(0);
+    buffer->m_NextFree = m_FreeSampleBuffers;
+    m_FreeSampleBuffers = buffer;
+}
+
 /*----------------------------------------------------------------------
 |   AP4_LinearReader::EnableTrack
 +---------------------------------------------------------------------*/
@@ -101,7 +137,7 @@ AP4_LinearReader::FlushQueue(Tracker* tracker)
          item = item->GetNext()) {
         SampleBuffer* buffer = item->GetData();
         m_BufferFullness -= buffer->m_Data.GetDataSize();
-        delete buffer;
+        ReleaseSampleBuffer(buffer);
     }
     tracker->m_Samples.Clear();
 }
@@ -131,7 +167,9 @@ AP4_LinearReader::Reset()
     if (m_Trackers[i]->m_SampleTableIsOwned) {
       delete m_Trackers[i]->m_SampleTable;
     }
-    delete m_Trackers[i]->m_NextSample;
+    if (m_Trackers[i]->m_NextSample) {
+      ReleaseSampleBuffer(m_Trackers[i]->m_NextSample);
+    }
     m_Trackers[i]->m_SampleTable = NULL;
     m_Trackers[i]->m_NextSample = NULL;
     m_Trackers[i]->m_NextSampleIndex = 0;
@@ -149,7 +187,9 @@ AP4_LinearReader::SetSampleIndex(AP4_UI32 track_id, AP4_UI32 sample_index)
     Tracker* tracker = FindTracker(track_id);
     if (tracker == NULL) return AP4_ERROR_INVALID_PARAMETERS;
     assert(tracker->m_SampleTable);
-    delete tracker->m_NextSample;
+    if (tracker->m_NextSample) {
+        ReleaseSampleBuffer(tracker->m_NextSample);
+    }
     tracker->m_NextSample = NULL;
     if (sample_index >= tracker->m_SampleTable->GetSampleCount()) {
         return AP4_ERROR_OUT_OF_RANGE;
@@ -163,7 +203,7 @@ AP4_LinearReader::SetSampleIndex(AP4_UI32 track_id, AP4_UI32 sample_index)
          item = item->GetNext()) {
         SampleBuffer* buffer = item->GetData();
         m_BufferFullness -= buffer->m_Data.GetDataSize();
-        delete buffer;
+        ReleaseSampleBuffer(buffer);
     }
     tracker->m_Samples.Clear();
     
@@ -430,19 +470,19 @@ AP4_LinearReader::Advance(bool read_data)
                     tracker->m_SampleTable = NULL;
                     continue;
                 }
-                tracker->m_NextSample = new AP4_Sample();
-                AP4_Result result = tracker->m_SampleTable->GetSample(tracker->m_NextSampleIndex, *tracker->m_NextSample);
+                tracker->m_NextSample = AcquireSampleBuffer();
+                AP4_Result result = tracker->m_SampleTable->GetSample(tracker->m_NextSampleIndex, tracker->m_NextSample->m_Sample);
                 if (AP4_FAILED(result)) {
                     tracker->m_Eos = true;
-                    delete tracker->m_NextSample;
+                    ReleaseSampleBuffer(tracker->m_NextSample);
                     tracker->m_NextSample = NULL;
                     continue;
                 }
-                tracker->m_NextDts += tracker->m_NextSample->GetDuration();
+                tracker->m_NextDts += tracker->m_NextSample->m_Sample.GetDuration();
             }
             assert(tracker->m_NextSample);
             
-            AP4_UI64 offset = tracker->m_NextSample->GetOffset();
+            AP4_UI64 offset = tracker->m_NextSample->m_Sample.GetOffset();
             if (offset < min_offset) {
                 min_offset = offset;
                 next_tracker = tracker;
@@ -461,22 +501,22 @@ AP4_LinearReader::Advance(bool read_data)
     if (next_tracker) {
         // read the sample into a buffer
         assert(next_tracker->m_NextSample);
-        SampleBuffer* buffer = new SampleBuffer(next_tracker->m_NextSample);
+        SampleBuffer* buffer = next_tracker->m_NextSample;
         AP4_Result result;
         if (read_data) {
             if (next_tracker->m_Reader) {
-                result = next_tracker->m_Reader->ReadSampleData(*buffer->m_Sample, buffer->m_Data);
+                result = next_tracker->m_Reader->ReadSampleData(buffer->m_Sample, buffer->m_Data);
             } else {
-                result = buffer->m_Sample->ReadData(buffer->m_Data);
+                result = buffer->m_Sample.ReadData(buffer->m_Data);
             }
             if (AP4_FAILED(result)) {
-                buffer->m_Sample = nullptr;
-                delete buffer;
+                // keep the sample, the read may be retried
+                buffer->m_Data.SetDataSize(0);
                 return result;
             }
 
             // detach the sample from its source now that we've read its data
-            buffer->m_Sample->Detach();
+            buffer->m_Sample.Detach();
         }
         
         // add the buffer to the queue
@@ -503,14 +543,13 @@ AP4_LinearReader::PopSample(Tracker*        tracker,
 {
     SampleBuffer* head = NULL;
     if (AP4_SUCCEEDED(tracker->m_Samples.PopHead(head)) && head) {
-        assert(head->m_Sample);
-        sample = *head->m_Sample;
+        sample = head->m_Sample;
         if (sample_data) {
             sample_data->SetData(head->m_Data.GetData(), head->m_Data.GetDataSize());
         }
         assert(m_BufferFullness >= head->m_Data.GetDataSize());
         m_BufferFullness -= head->m_Data.GetDataSize();
-        delete head;
+        ReleaseSampleBuffer(head);
         return true;
     }
     
@@ -621,7 +660,7 @@ AP4_LinearReader::ReadNextSample(AP4_Sample&     sample,
             
             AP4_List<SampleBuffer>::Item* item = tracker->m_Samples.FirstItem();
             if (item) {
-                AP4_UI64 offset = item->GetData()->m_Sample->GetOffset();
+                AP4_UI64 offset = item->GetData()->m_Sample.GetOffset();
                 if (offset < min_offset) {
                     min_offset = offset;
                     next_tracker = tracker;
@@ -102,12 +102,14 @@ public:
     };
 
 protected:
+    // sample buffers are recycled through the reader's free list, the
+    // data buffer keeps its capacity between samples
     class SampleBuffer {
     public:
-        SampleBuffer(AP4_Sample* sample) : m_Sample(sample) {}
-       ~SampleBuffer() { delete m_Sample; } 
-        AP4_Sample*    m_Sample;
+        SampleBuffer() : m_NextFree(NULL) {}
+        AP4_Sample     m_Sample;
         AP4_DataBuffer m_Data;
+        SampleBuffer*  m_NextFree;
     };
         
     class Tracker {
@@ -144,7 +146,7 @@ protected:
         AP4_Track*             m_Track;
         AP4_SampleTable*       m_SampleTable;
         bool                   m_SampleTableIsOwned;
-        AP4_Sample*            m_NextSample;
+        SampleBuffer*          m_NextSample;
         AP4_Ordinal            m_NextSampleIndex;
         AP4_UI64               m_NextDts;
         AP4_List<SampleBuffer> m_Samples;
@@ -176,6 +178,8 @@ protected:
     void       FlushQueue(Tracker* tracker);
     void       FlushQueues();
     void       Reset();
+    SampleBuffer* AcquireSampleBuffer();
+    void       ReleaseSampleBuffer(SampleBuffer* buffer);
     
     // members
     AP4_Movie&          m_Movie;
@@ -188,6 +192,7 @@ protected:
     AP4_Size            m_BufferFullnessPeak;
     AP4_Size            m_MaxBufferFullness;
     AP4_ContainerAtom*  m_Mfra;
+    SampleBuffer*       m_FreeSampleBuffers;
 };
 
 /*----------------------------------------------------------------------
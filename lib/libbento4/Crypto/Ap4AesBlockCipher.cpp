@@ -39,6 +39,7 @@ Issue Date: 29/07/2002
 #include "Ap4AesBlockCipher.h"
 #include "Ap4Results.h"
 #include "Ap4Utils.h"
+#include "Ap4AesHw.h"
 
 /*----------------------------------------------------------------------
 |   AES types
@@ -50,6 +51,8 @@ struct aes_ctx                     // the AES context for encryption
 {   aes_32t    k_sch[4*AP4_AES_BLOCK_SIZE];   // the encryption key schedule
     aes_32t    n_rnd;              // the number of cipher rounds
     aes_32t    n_blk;              // the number of bytes in the state
+    bool       hw;                 // use the AES instructions of the CPU
+    aes_08t    hw_keys[AP4_AES_HW_ROUND_KEYS_SIZE]; // their round keys
 };
 #define aes_bad      0             // bad function return value
 #define aes_good     1             // good function return value
@@ -1869,7 +1872,13 @@ AP4_AesCbcBlockCipher::Process(const AP4_UI08* input,
     
     // process all blocks
     unsigned int block_count = input_size/AP4_AES_BLOCK_SIZE;
-    if (m_Direction == ENCRYPT) {
+    if (m_Context->hw) {
+        if (m_Direction == ENCRYPT) {
+            AP4_AesHwEncryptCbc(m_Context->hw_keys, chaining_block, input, block_count, output);
+        } else {
+            AP4_AesHwDecryptCbc(m_Context->hw_keys, chaining_block, input, block_count, output);
+        }
+    } else if (m_Direction == ENCRYPT) {
         for (unsigned int i=0; i<block_count; i++) {
             AP4_UI08 block[AP4_AES_BLOCK_SIZE];
             for (unsigned int j=0; j<AP4_AES_BLOCK_SIZE; j++) {
@@ -1917,6 +1926,15 @@ public:
 //    unsigned int m_CounterSize;
 };
 
+/*----------------------------------------------------------------------
+|   AP4_AesCtrWord
++---------------------------------------------------------------------*/
+#if defined(AP4_CONFIG_HAVE_INT64)
+typedef AP4_UI64 AP4_AesCtrWord;
+#else
+typedef AP4_UI32 AP4_AesCtrWord;
+#endif
+
 /*----------------------------------------------------------------------
 |   AP4_AesCtrBlockCipher::Process
 +---------------------------------------------------------------------*/
@@ -1934,16 +1952,20 @@ AP4_AesCtrBlockCipher::Process(const AP4_UI08* input,
         AP4_SetMemory(counter, 0, AP4_AES_BLOCK_SIZE);
     }
     
-    // process all blocks
+    if (m_Context->hw) {
+        AP4_AesHwProcessCtr(m_Context->hw_keys, counter, input, input_size, output);
+        return AP4_SUCCESS;
+    }
+
+    // process all blocks, generating the key stream for several blocks
+    // at a time so that it can be applied one machine word at a time
+    const unsigned int batch_size = 4*AP4_AES_BLOCK_SIZE;
+    AP4_UI08 stream[batch_size];
     while (input_size) {
-        AP4_UI08 block[AP4_AES_BLOCK_SIZE];
-        aes_enc_blk(counter, block, m_Context);
-        unsigned int chunk = input_size>=AP4_AES_BLOCK_SIZE?AP4_AES_BLOCK_SIZE:input_size;
-        for (unsigned int j=0; j<chunk; j++) {
-            output[j] = input[j]^block[j];
-        }
-        input_size -= chunk;
-        if (input_size) {
+        unsigned int chunk = input_size>=batch_size?batch_size:input_size;
+        for (unsigned int b=0; b<chunk; b+=AP4_AES_BLOCK_SIZE) {
+            aes_enc_blk(counter, stream+b, m_Context);
+
             // increment the counter
             for (int x=AP4_AES_BLOCK_SIZE-1; x; --x) {
                 if (counter[x] == 255) {
@@ -1954,11 +1976,21 @@ AP4_AesCtrBlockCipher::Process(const AP4_UI08* input,
                     break;
                 }
             }
-            
-            // move to the next block
-            input  += AP4_AES_BLOCK_SIZE;
-            output += AP4_AES_BLOCK_SIZE;
         }
+        unsigned int j=0;
+        for (; j+sizeof(AP4_AesCtrWord)<=chunk; j+=sizeof(AP4_AesCtrWord)) {
+            AP4_AesCtrWord x, k;
+            AP4_CopyMemory(&x, input+j, sizeof(x));
+            AP4_CopyMemory(&k, stream+j, sizeof(k));
+            x ^= k;
+            AP4_CopyMemory(output+j, &x, sizeof(x));
+        }
+        for (; j<chunk; j++) {
+            output[j] = input[j]^stream[j];
+        }
+        input      += chunk;
+        output     += chunk;
+        input_size -= chunk;
     }
     return AP4_SUCCESS;
 }
@@ -1976,10 +2008,15 @@ AP4_AesBlockCipher::Create(const AP4_UI08*      key,
     cipher = NULL;
 
     aes_ctx* context = new aes_ctx();
+
+    // prefer the AES instructions of the CPU, the tables are the fallback
+    context->hw = AP4_AesHwIsAvailable();
     
     switch (mode) {
         case AP4_BlockCipher::CBC:
-            if (direction == AP4_BlockCipher::ENCRYPT) {
+            if (context->hw) {
+                AP4_AesHwExpandKey(key, direction == AP4_BlockCipher::DECRYPT, context->hw_keys);
+            } else if (direction == AP4_BlockCipher::ENCRYPT) {
                 aes_enc_key(key, AP4_AES_KEY_LENGTH, context);
             } else {
                 aes_dec_key(key, AP4_AES_KEY_LENGTH, context);
@@ -1988,7 +2025,11 @@ AP4_AesBlockCipher::Create(const AP4_UI08*      key,
             break;
             
         case AP4_BlockCipher::CTR: {
-            aes_enc_key(key, AP4_AES_KEY_LENGTH, context);
+            if (context->hw) {
+                AP4_AesHwExpandKey(key, false, context->hw_keys);
+            } else {
+                aes_enc_key(key, AP4_AES_KEY_LENGTH, context);
+            }
             const AP4_BlockCipher::CtrParams* ctr_params = (const AP4_BlockCipher::CtrParams*)mode_params;
             unsigned int counter_size = 16;
             if (ctr_params) {
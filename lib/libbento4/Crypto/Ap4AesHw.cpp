@@ -0,0 +1,494 @@
+/*
+ * Hardware accelerated AES-128
+ * x86 AES-NI / ARMv8 cryptography extensions, selected at runtime
+ */
+
+/*----------------------------------------------------------------------
+|   includes
++---------------------------------------------------------------------*/
+#include "Ap4AesHw.h"
+#include "Ap4Utils.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AP4_AES_HW_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AP4_AES_HW_TARGET
+#else
+#include <cpuid.h>
+#define AP4_AES_HW_TARGET __attribute__((target("aes,sse2")))
+#endif
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define AP4_AES_HW_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#endif
+
+#if defined(AP4_AES_HW_X86) || defined(AP4_AES_HW_ARM)
+
+/*----------------------------------------------------------------------
+|   constants
++---------------------------------------------------------------------*/
+// blocks in flight: the AES instructions are pipelined, independent
+// blocks interleaved round by round hide their latency. This applies to
+// CTR and to CBC decryption, where every ciphertext block is known upfront
+#define AP4_AES_HW_LANES 8
+
+// the lanes only stay in registers when the loops over them are unrolled,
+// which gcc does not do by itself at -O2
+#if defined(__GNUC__)
+#define AP4_AES_HW_UNROLL _Pragma("GCC unroll 16")
+#else
+#define AP4_AES_HW_UNROLL
+#endif
+
+/*----------------------------------------------------------------------
+|   AP4_AesSbox
++---------------------------------------------------------------------*/
+static const AP4_UI08 AP4_AesSbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/*----------------------------------------------------------------------
+|   AP4_AesExpandKey128
++---------------------------------------------------------------------*/
+static void
+AP4_AesExpandKey128(const AP4_UI08* key, AP4_UI08* round_keys)
+{
+    AP4_CopyMemory(round_keys, key, 16);
+    AP4_UI08 rcon = 1;
+    for (unsigned int i=16; i<AP4_AES_HW_ROUND_KEYS_SIZE; i+=4) {
+        AP4_UI08 t[4] = { round_keys[i-4], round_keys[i-3], round_keys[i-2], round_keys[i-1] };
+        if ((i & 15) == 0) {
+            AP4_UI08 t0 = t[0];
+            t[0] = AP4_AesSbox[t[1]]^rcon;
+            t[1] = AP4_AesSbox[t[2]];
+            t[2] = AP4_AesSbox[t[3]];
+            t[3] = AP4_AesSbox[t0];
+            rcon = (AP4_UI08)((rcon<<1)^((rcon&0x80)?0x1b:0));
+        }
+        for (unsigned int j=0; j<4; j++) {
+            round_keys[i+j] = round_keys[i-16+j]^t[j];
+        }
+    }
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesIncrementCounter
++---------------------------------------------------------------------*/
+static inline void
+AP4_AesIncrementCounter(AP4_UI08* counter)
+{
+    // same as the table implementation: byte 0 never carries
+    for (int x=15; x; --x) {
+        if (++counter[x]) break;
+    }
+}
+
+#endif
+
+#if defined(AP4_AES_HW_X86)
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwDetect
++---------------------------------------------------------------------*/
+static bool
+AP4_AesHwDetect()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1<<25)) != 0;
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    return (c & (1<<25)) != 0;
+#endif
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwExpandKey
++---------------------------------------------------------------------*/
+AP4_AES_HW_TARGET void
+AP4_AesHwExpandKey(const AP4_UI08* key, bool decrypt, AP4_UI08* round_keys)
+{
+    AP4_AesExpandKey128(key, round_keys);
+    if (!decrypt) return;
+
+    // equivalent inverse cipher: reversed order, InvMixColumns on the inner keys
+    __m128i k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(round_keys+16*i));
+    }
+    _mm_storeu_si128((__m128i*)round_keys, k[10]);
+    for (unsigned int i=1; i<10; i++) {
+        _mm_storeu_si128((__m128i*)(round_keys+16*i), _mm_aesimc_si128(k[10-i]));
+    }
+    _mm_storeu_si128((__m128i*)(round_keys+160), k[0]);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwEncryptBlock
++---------------------------------------------------------------------*/
+static AP4_AES_HW_TARGET inline __m128i
+AP4_AesHwEncryptBlock(const __m128i* k, __m128i x)
+{
+    x = _mm_xor_si128(x, k[0]);
+    for (unsigned int i=1; i<10; i++) {
+        x = _mm_aesenc_si128(x, k[i]);
+    }
+    return _mm_aesenclast_si128(x, k[10]);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwProcessCtr
++---------------------------------------------------------------------*/
+AP4_AES_HW_TARGET void
+AP4_AesHwProcessCtr(const AP4_UI08* round_keys,
+                    AP4_UI08*       counter,
+                    const AP4_UI08* input,
+                    AP4_Size        input_size,
+                    AP4_UI08*       output)
+{
+    __m128i k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(round_keys+16*i));
+    }
+    while (input_size >= 16*AP4_AES_HW_LANES) {
+        __m128i x[AP4_AES_HW_LANES];
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)counter), k[0]);
+            AP4_AesIncrementCounter(counter);
+        }
+        for (unsigned int r=1; r<10; r++) {
+            AP4_AES_HW_UNROLL
+            for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+                x[i] = _mm_aesenc_si128(x[i], k[r]);
+            }
+        }
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = _mm_aesenclast_si128(x[i], k[10]);
+            _mm_storeu_si128((__m128i*)(output+16*i), _mm_xor_si128(x[i], _mm_loadu_si128((const __m128i*)(input+16*i))));
+        }
+        input      += 16*AP4_AES_HW_LANES;
+        output     += 16*AP4_AES_HW_LANES;
+        input_size -= 16*AP4_AES_HW_LANES;
+    }
+    while (input_size) {
+        __m128i block = AP4_AesHwEncryptBlock(k, _mm_loadu_si128((const __m128i*)counter));
+        if (input_size >= 16) {
+            _mm_storeu_si128((__m128i*)output, _mm_xor_si128(block, _mm_loadu_si128((const __m128i*)input)));
+            input_size -= 16;
+        } else {
+            AP4_UI08 pad[16];
+            _mm_storeu_si128((__m128i*)pad, block);
+            for (unsigned int j=0; j<input_size; j++) {
+                output[j] = input[j]^pad[j];
+            }
+            input_size = 0;
+        }
+        if (input_size) {
+            AP4_AesIncrementCounter(counter);
+            input  += 16;
+            output += 16;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwEncryptCbc
++---------------------------------------------------------------------*/
+AP4_AES_HW_TARGET void
+AP4_AesHwEncryptCbc(const AP4_UI08* round_keys,
+                    AP4_UI08*       chaining_block,
+                    const AP4_UI08* input,
+                    unsigned int    block_count,
+                    AP4_UI08*       output)
+{
+    __m128i k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(round_keys+16*i));
+    }
+    __m128i chain = _mm_loadu_si128((const __m128i*)chaining_block);
+    for (unsigned int i=0; i<block_count; i++, input+=16, output+=16) {
+        chain = AP4_AesHwEncryptBlock(k, _mm_xor_si128(chain, _mm_loadu_si128((const __m128i*)input)));
+        _mm_storeu_si128((__m128i*)output, chain);
+    }
+    _mm_storeu_si128((__m128i*)chaining_block, chain);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwDecryptCbc
++---------------------------------------------------------------------*/
+AP4_AES_HW_TARGET void
+AP4_AesHwDecryptCbc(const AP4_UI08* round_keys,
+                    AP4_UI08*       chaining_block,
+                    const AP4_UI08* input,
+                    unsigned int    block_count,
+                    AP4_UI08*       output)
+{
+    __m128i k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(round_keys+16*i));
+    }
+    __m128i chain = _mm_loadu_si128((const __m128i*)chaining_block);
+    for (; block_count >= AP4_AES_HW_LANES; block_count -= AP4_AES_HW_LANES) {
+        __m128i in[AP4_AES_HW_LANES], x[AP4_AES_HW_LANES];
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            in[i] = _mm_loadu_si128((const __m128i*)(input+16*i));
+            x[i]  = _mm_xor_si128(in[i], k[0]);
+        }
+        for (unsigned int r=1; r<10; r++) {
+            AP4_AES_HW_UNROLL
+            for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+                x[i] = _mm_aesdec_si128(x[i], k[r]);
+            }
+        }
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = _mm_aesdeclast_si128(x[i], k[10]);
+            _mm_storeu_si128((__m128i*)(output+16*i), _mm_xor_si128(x[i], i ? in[i-1] : chain));
+        }
+        chain   = in[AP4_AES_HW_LANES-1];
+        input  += 16*AP4_AES_HW_LANES;
+        output += 16*AP4_AES_HW_LANES;
+    }
+    for (unsigned int i=0; i<block_count; i++, input+=16, output+=16) {
+        __m128i in = _mm_loadu_si128((const __m128i*)input);
+        __m128i x  = _mm_xor_si128(in, k[0]);
+        for (unsigned int r=1; r<10; r++) {
+            x = _mm_aesdec_si128(x, k[r]);
+        }
+        x = _mm_aesdeclast_si128(x, k[10]);
+        _mm_storeu_si128((__m128i*)output, _mm_xor_si128(x, chain));
+        chain = in;
+    }
+    _mm_storeu_si128((__m128i*)chaining_block, chain);
+}
+
+#elif defined(AP4_AES_HW_ARM)
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwDetect
++---------------------------------------------------------------------*/
+static bool
+AP4_AesHwDetect()
+{
+#if defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return false;
+#endif
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwExpandKey
++---------------------------------------------------------------------*/
+void
+AP4_AesHwExpandKey(const AP4_UI08* key, bool decrypt, AP4_UI08* round_keys)
+{
+    AP4_AesExpandKey128(key, round_keys);
+    if (!decrypt) return;
+
+    // equivalent inverse cipher: reversed order, InvMixColumns on the inner keys
+    uint8x16_t k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = vld1q_u8(round_keys+16*i);
+    }
+    vst1q_u8(round_keys, k[10]);
+    for (unsigned int i=1; i<10; i++) {
+        vst1q_u8(round_keys+16*i, vaesimcq_u8(k[10-i]));
+    }
+    vst1q_u8(round_keys+160, k[0]);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwEncryptBlock
++---------------------------------------------------------------------*/
+static inline uint8x16_t
+AP4_AesHwEncryptBlock(const uint8x16_t* k, uint8x16_t x)
+{
+    for (unsigned int i=0; i<9; i++) {
+        x = vaesmcq_u8(vaeseq_u8(x, k[i]));
+    }
+    return veorq_u8(vaeseq_u8(x, k[9]), k[10]);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwProcessCtr
++---------------------------------------------------------------------*/
+void
+AP4_AesHwProcessCtr(const AP4_UI08* round_keys,
+                    AP4_UI08*       counter,
+                    const AP4_UI08* input,
+                    AP4_Size        input_size,
+                    AP4_UI08*       output)
+{
+    uint8x16_t k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = vld1q_u8(round_keys+16*i);
+    }
+    while (input_size >= 16*AP4_AES_HW_LANES) {
+        uint8x16_t x[AP4_AES_HW_LANES];
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = vld1q_u8(counter);
+            AP4_AesIncrementCounter(counter);
+        }
+        for (unsigned int r=0; r<9; r++) {
+            AP4_AES_HW_UNROLL
+            for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+                x[i] = vaesmcq_u8(vaeseq_u8(x[i], k[r]));
+            }
+        }
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = veorq_u8(vaeseq_u8(x[i], k[9]), k[10]);
+            vst1q_u8(output+16*i, veorq_u8(x[i], vld1q_u8(input+16*i)));
+        }
+        input      += 16*AP4_AES_HW_LANES;
+        output     += 16*AP4_AES_HW_LANES;
+        input_size -= 16*AP4_AES_HW_LANES;
+    }
+    while (input_size) {
+        uint8x16_t block = AP4_AesHwEncryptBlock(k, vld1q_u8(counter));
+        if (input_size >= 16) {
+            vst1q_u8(output, veorq_u8(block, vld1q_u8(input)));
+            input_size -= 16;
+        } else {
+            AP4_UI08 pad[16];
+            vst1q_u8(pad, block);
+            for (unsigned int j=0; j<input_size; j++) {
+                output[j] = input[j]^pad[j];
+            }
+            input_size = 0;
+        }
+        if (input_size) {
+            AP4_AesIncrementCounter(counter);
+            input  += 16;
+            output += 16;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwEncryptCbc
++---------------------------------------------------------------------*/
+void
+AP4_AesHwEncryptCbc(const AP4_UI08* round_keys,
+                    AP4_UI08*       chaining_block,
+                    const AP4_UI08* input,
+                    unsigned int    block_count,
+                    AP4_UI08*       output)
+{
+    uint8x16_t k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = vld1q_u8(round_keys+16*i);
+    }
+    uint8x16_t chain = vld1q_u8(chaining_block);
+    for (unsigned int i=0; i<block_count; i++, input+=16, output+=16) {
+        chain = AP4_AesHwEncryptBlock(k, veorq_u8(chain, vld1q_u8(input)));
+        vst1q_u8(output, chain);
+    }
+    vst1q_u8(chaining_block, chain);
+}
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwDecryptCbc
++---------------------------------------------------------------------*/
+void
+AP4_AesHwDecryptCbc(const AP4_UI08* round_keys,
+                    AP4_UI08*       chaining_block,
+                    const AP4_UI08* input,
+                    unsigned int    block_count,
+                    AP4_UI08*       output)
+{
+    uint8x16_t k[11];
+    for (unsigned int i=0; i<11; i++) {
+        k[i] = vld1q_u8(round_keys+16*i);
+    }
+    uint8x16_t chain = vld1q_u8(chaining_block);
+    for (; block_count >= AP4_AES_HW_LANES; block_count -= AP4_AES_HW_LANES) {
+        uint8x16_t in[AP4_AES_HW_LANES], x[AP4_AES_HW_LANES];
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            in[i] = vld1q_u8(input+16*i);
+            x[i]  = in[i];
+        }
+        for (unsigned int r=0; r<9; r++) {
+            AP4_AES_HW_UNROLL
+            for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+                x[i] = vaesimcq_u8(vaesdq_u8(x[i], k[r]));
+            }
+        }
+        AP4_AES_HW_UNROLL
+        for (unsigned int i=0; i<AP4_AES_HW_LANES; i++) {
+            x[i] = veorq_u8(vaesdq_u8(x[i], k[9]), k[10]);
+            vst1q_u8(output+16*i, veorq_u8(x[i], i ? in[i-1] : chain));
+        }
+        chain   = in[AP4_AES_HW_LANES-1];
+        input  += 16*AP4_AES_HW_LANES;
+        output += 16*AP4_AES_HW_LANES;
+    }
+    for (unsigned int i=0; i<block_count; i++, input+=16, output+=16) {
+        uint8x16_t in = vld1q_u8(input);
+        uint8x16_t x  = in;
+        for (unsigned int r=0; r<9; r++) {
+            x = vaesimcq_u8(vaesdq_u8(x, k[r]));
+        }
+        x = veorq_u8(vaesdq_u8(x, k[9]), k[10]);
+        vst1q_u8(output, veorq_u8(x, chain));
+        chain = in;
+    }
+    vst1q_u8(chaining_block, chain);
+}
+
+#else
+
+/*----------------------------------------------------------------------
+|   no hardware support compiled in
++---------------------------------------------------------------------*/
+static bool AP4_AesHwDetect() { return false; }
+void AP4_AesHwExpandKey(const AP4_UI08*, bool, AP4_UI08*) {}
+void AP4_AesHwProcessCtr(const AP4_UI08*, AP4_UI08*, const AP4_UI08*, AP4_Size, AP4_UI08*) {}
+void AP4_AesHwEncryptCbc(const AP4_UI08*, AP4_UI08*, const AP4_UI08*, unsigned int, AP4_UI08*) {}
+void AP4_AesHwDecryptCbc(const AP4_UI08*, AP4_UI08*, const AP4_UI08*, unsigned int, AP4_UI08*) {}
+
+#endif
+
+/*----------------------------------------------------------------------
+|   AP4_AesHwIsAvailable
++---------------------------------------------------------------------*/
+bool
+AP4_AesHwIsAvailable()
+{
+    static const bool available = AP4_AesHwDetect();
+    return available;
+}
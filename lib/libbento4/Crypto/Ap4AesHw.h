@@ -0,0 +1,58 @@
+/*
+ * Hardware accelerated AES-128
+ * x86 AES-NI / ARMv8 cryptography extensions, selected at runtime
+ */
+
+#ifndef _AP4_AES_HW_H_
+#define _AP4_AES_HW_H_
+
+/*----------------------------------------------------------------------
+|   includes
++---------------------------------------------------------------------*/
+#include "Ap4Types.h"
+
+/*----------------------------------------------------------------------
+|   constants
++---------------------------------------------------------------------*/
+#define AP4_AES_HW_ROUND_KEYS_SIZE (11*16)
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+/**
+ * Returns true if the CPU we run on supports the AES instructions.
+ * None of the functions below may be called otherwise.
+ */
+bool AP4_AesHwIsAvailable();
+
+/**
+ * Expands a 128 bit key into round_keys (AP4_AES_HW_ROUND_KEYS_SIZE bytes).
+ * Decryption keys are only needed for CBC decryption.
+ */
+void AP4_AesHwExpandKey(const AP4_UI08* key, bool decrypt, AP4_UI08* round_keys);
+
+/**
+ * CTR mode, the last block may be partial. The counter is incremented
+ * between blocks (bytes 15 to 1, big endian).
+ */
+void AP4_AesHwProcessCtr(const AP4_UI08* round_keys,
+                         AP4_UI08*       counter,
+                         const AP4_UI08* input,
+                         AP4_Size        input_size,
+                         AP4_UI08*       output);
+
+/**
+ * CBC mode on whole blocks, chaining_block is updated for the next call.
+ */
+void AP4_AesHwEncryptCbc(const AP4_UI08* round_keys,
+                         AP4_UI08*       chaining_block,
+                         const AP4_UI08* input,
+                         unsigned int    block_count,
+                         AP4_UI08*       output);
+void AP4_AesHwDecryptCbc(const AP4_UI08* round_keys,
+                         AP4_UI08*       chaining_block,
+                         const AP4_UI08* input,
+                         unsigned int    block_count,
+                         AP4_UI08*       output);
+
+#endif // _AP4_AES_HW_H_
@@ -171,8 +171,9 @@ AP4_CtrStreamCipher::ProcessBuffer(const AP4_UI08* in,
         in_size        -= partial;
     }
     
-    // process all the remaining bytes in the buffer
-    if (in_size) {
+    // process all the remaining full blocks in the buffer
+    AP4_Size full = in_size-in_size%AP4_CIPHER_BLOCK_SIZE;
+    if (full) {
         // the cache won't be valid anymore
         m_CacheValid = false;
 
@@ -181,13 +182,35 @@ AP4_CtrStreamCipher::ProcessBuffer(const AP4_UI08* in,
         ComputeCounter(m_StreamOffset, counter_block);
         
         // process the data
-        AP4_Result result = m_BlockCipher->Process(in, in_size, out, counter_block);
+        AP4_Result result = m_BlockCipher->Process(in, full, out, counter_block);
         if (AP4_FAILED(result)) {
             if (out_size) *out_size = 0;
             return result;
         }
+        m_StreamOffset += full;
+        in             += full;
+        out            += full;
+        in_size        -= full;
+    }
+
+    // keep the key stream of a trailing partial block in the cache, so
+    // that the next buffer (the next subsample of a CENC sample) picks up
+    // where this one stopped without encrypting the counter again
+    if (in_size) {
+        AP4_UI08 block[AP4_CIPHER_BLOCK_SIZE] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+        AP4_UI08 counter_block[AP4_CIPHER_BLOCK_SIZE];
+        ComputeCounter(m_StreamOffset, counter_block);
+        AP4_Result result = m_BlockCipher->Process(block, AP4_CIPHER_BLOCK_SIZE, m_CacheBlock, counter_block);
+        if (AP4_FAILED(result)) {
+            m_CacheValid = false;
+            if (out_size) *out_size = 0;
+            return result;
+        }
+        m_CacheValid = true;
+        for (unsigned int i=0; i<in_size; i++) {
+            out[i] = in[i]^m_CacheBlock[i];
+        }
         m_StreamOffset += in_size;
-        return result;
     }
     
     return AP4_SUCCESS;
@@ -41,6 +41,8 @@ AVContext::AVContext(TSDemuxer* const demux, uint64_t pos, uint16_t channel)
   , payload_unit_pos(0)
   , av_data_len(FLUTS_NORMAL_TS_PACKETSIZE)
   , av_pkt_size(0)
+  , av_cache_pos(0)
+  , av_cache_len(0)
   , is_configured(false)
   , channel(channel)
   , pid(0xffff)
@@ -249,6 +251,58 @@ STREAM_TYPE AVContext::get_stream_type(uint8_t pes_type)
   return STREAM_TYPE_UNKNOWN;
 }
 
+const unsigned char* AVContext::peek_av(uint64_t pos, size_t len)
+{
+  if (pos < av_cache_pos || pos + len > av_cache_pos + av_cache_len)
+  {
+    av_cache_pos = pos;
+    av_cache_len = m_demux->ReadAVBlock(pos, av_cache, len, AV_CONTEXT_CACHESIZE);
+    if (av_cache_len < len)
+    {
+      av_cache_len = 0;
+      return NULL;
+    }
+  }
+  return av_cache + (pos - av_cache_pos);
+}
+
+bool AVContext::read_av(uint64_t pos, unsigned char* buffer, size_t len)
+{
+  const unsigned char* data = peek_av(pos, len);
+  if (!data)
+    return false;
+  memcpy(buffer, data, len);
+  return true;
+}
+
+/*
+ * Move pos to the next sync byte, looking at no more than max_len bytes.
+ * memchr over the cached block is vectorized by the C runtime.
+ */
+int AVContext::scan_sync(uint64_t& pos, size_t max_len)
+{
+  while (max_len)
+  {
+    const unsigned char* data = peek_av(pos, 1);
+    if (!data)
+      return AVCONTEXT_IO_ERROR;
+
+    size_t avail = av_cache_len - (size_t)(pos - av_cache_pos);
+    if (avail > max_len)
+      avail = max_len;
+
+    const unsigned char* sync = (const unsigned char*)memchr(data, 0x47, avail);
+    if (sync)
+    {
+      pos += sync - data;
+      return AVCONTEXT_CONTINUE;
+    }
+    pos += avail;
+    max_len -= avail;
+  }
+  return AVCONTEXT_TS_NOSYNC;
+}
+
 int AVContext::configure_ts()
 {
   uint64_t pos = av_pos;
@@ -259,73 +313,59 @@ int AVContext::configure_ts()
     {FLUTS_ATSC_TS_PACKETSIZE, 0}
   };
 
-  uint8_t data[AV_CONTEXT_PACKETSIZE];
-  size_t data_size(0);
-
   int nb = sizeof (fluts) / (2 * sizeof (int));
   int score = TS_CHECK_MIN_SCORE;
 
-  for (int i = 0; i < MAX_RESYNC_SIZE; i++)
+  while (pos - av_pos < MAX_RESYNC_SIZE)
   {
-    if (!data_size)
-      data_size = m_demux->ReadAV(pos, data, AV_CONTEXT_PACKETSIZE) ? AV_CONTEXT_PACKETSIZE : 0;
-
-    if (!data_size)
-      return AVCONTEXT_IO_ERROR;
+    int ret = scan_sync(pos, (size_t)(MAX_RESYNC_SIZE - (pos - av_pos)));
+    if (ret == AVCONTEXT_IO_ERROR)
+      return ret;
+    if (ret != AVCONTEXT_CONTINUE)
+      break;
 
-    if (data[AV_CONTEXT_PACKETSIZE - data_size] == 0x47)
+    int count, found;
+    for (int t = 0; t < nb; t++) // for all fluts
     {
-      int count, found;
-      for (int t = 0; t < nb; t++) // for all fluts
+      unsigned char ndata;
+      uint64_t npos = pos;
+      int do_retry = score; // Reach for score
+      do
       {
-        unsigned char ndata;
-        uint64_t npos = pos;
-        int do_retry = score; // Reach for score
-        do
-        {
-          --do_retry;
-          npos += fluts[t][0];
-          if (!m_demux->ReadAV(npos, &ndata, 1))
-            return AVCONTEXT_IO_ERROR;
-        }
-        while (ndata == 0x47 && (++fluts[t][1]) && do_retry);
-      }
-      // Is score reached ?
-      count = found = 0;
-      for (int t = 0; t < nb; t++)
-      {
-        if (fluts[t][1] == score)
-        {
-          found = t;
-          ++count;
-        }
-        // Reset score for next retry
-        fluts[t][1] = 0;
+        --do_retry;
+        npos += fluts[t][0];
+        if (!read_av(npos, &ndata, 1))
+          return AVCONTEXT_IO_ERROR;
       }
-      // One and only one is eligible
-      if (count == 1)
-      {
-        DBG(DEMUX_DBG_DEBUG, "%s: packet size is %d\n", __FUNCTION__, fluts[found][0]);
-        av_pkt_size = fluts[found][0];
-        av_pos = pos;
-        return AVCONTEXT_CONTINUE;
-      }
-      // More one: Retry for highest score
-      else if (count > 1 && ++score > TS_CHECK_MAX_SCORE)
-        // Packet size remains undetermined
-        break;
-      // None: Bad sync. Shift and retry
-      else
+      while (ndata == 0x47 && (++fluts[t][1]) && do_retry);
+    }
+    // Is score reached ?
+    count = found = 0;
+    for (int t = 0; t < nb; t++)
+    {
+      if (fluts[t][1] == score)
       {
-        --data_size;
-        pos++;
+        found = t;
+        ++count;
       }
+      // Reset score for next retry
+      fluts[t][1] = 0;
     }
-    else
+    // One and only one is eligible
+    if (count == 1)
     {
-      --data_size;
-      pos++;
+      DBG(DEMUX_DBG_DEBUG, "%s: packet size is %d\n", __FUNCTION__, fluts[found][0]);
+      av_pkt_size = fluts[found][0];
+      av_pos = pos;
+      return AVCONTEXT_CONTINUE;
     }
+    // More one: Retry for highest score
+    else if (count > 1 && ++score > TS_CHECK_MAX_SCORE)
+      // Packet size remains undetermined
+      break;
+    // None: Bad sync. Shift and retry
+    else if (!count)
+      pos++;
   }
 
   DBG(DEMUX_DBG_ERROR, "%s: invalid stream\n", __FUNCTION__);
@@ -342,32 +382,21 @@ int AVContext::TSResync()
     is_configured = true;
   }
 
-  size_t data_size(0);
+  if (!read_av(av_pos, av_buf, av_pkt_size))
+    return AVCONTEXT_IO_ERROR;
 
-  for (int i = 0; i < MAX_RESYNC_SIZE; i++)
+  // Lost sync: find the next sync byte
+  if (av_buf[0] != 0x47)
   {
-    if (!data_size)
-      data_size = m_demux->ReadAV(av_pos, av_buf, av_pkt_size) ? av_pkt_size : 0;
-
-    if (!data_size)
+    int ret = scan_sync(av_pos, MAX_RESYNC_SIZE);
+    if (ret != AVCONTEXT_CONTINUE)
+      return ret;
+    if (!read_av(av_pos, av_buf, av_pkt_size))
       return AVCONTEXT_IO_ERROR;
-
-    if (av_buf[av_pkt_size - data_size] == 0x47)
-    {
-      if (data_size != av_pkt_size)
-        data_size = m_demux->ReadAV(av_pos, av_buf, av_pkt_size) ? av_pkt_size : 0;
-
-      if (data_size)
-      {
-        Reset();
-        return AVCONTEXT_CONTINUE;
-      }
-    }
-    av_pos++;
-    --data_size;
   }
 
-  return AVCONTEXT_TS_NOSYNC;
+  Reset();
+  return AVCONTEXT_CONTINUE;
 }
 
 uint64_t AVContext::GoNext()
@@ -387,6 +416,8 @@ uint64_t AVContext::Shift()
 void AVContext::GoPosition(uint64_t pos, bool rp)
 {
   av_pos = pos;
+  // The stream may deliver other data at this position now (seek)
+  av_cache_len = 0;
   Reset();
   if(rp)
     for (std::map<uint16_t, Packet>::iterator it = this->packets.begin(); it != this->packets.end(); ++it)
@@ -35,6 +35,7 @@
 #define FLUTS_ATSC_TS_PACKETSIZE    208
 
 #define AV_CONTEXT_PACKETSIZE       208
+#define AV_CONTEXT_CACHESIZE        65536
 #define TS_CHECK_MIN_SCORE          2
 #define TS_CHECK_MAX_SCORE          10
 
@@ -44,6 +45,8 @@ namespace TSDemux
   {
   public:
     virtual bool ReadAV(uint64_t pos, unsigned char* buffer, size_t len) = 0;
+    // Reads at least len and up to maxLen bytes, returns the number of bytes read or 0 on failure
+    virtual size_t ReadAVBlock(uint64_t pos, unsigned char* buffer, size_t len, size_t /*maxLen*/) { return ReadAV(pos, buffer, len) ? len : 0; }
   };
 
   enum {
@@ -92,6 +95,9 @@ namespace TSDemux
     AVContext& operator=(const AVContext&);
 
     int configure_ts();
+    const unsigned char* peek_av(uint64_t pos, size_t len);
+    bool read_av(uint64_t pos, unsigned char* buffer, size_t len);
+    int scan_sync(uint64_t& pos, size_t max_len);
     static STREAM_TYPE get_stream_type(uint8_t pes_type);
     static uint8_t av_rb8(const unsigned char* p);
     static uint16_t av_rb16(const unsigned char* p);
@@ -117,6 +123,11 @@ namespace TSDemux
     size_t av_pkt_size;
     unsigned char av_buf[AV_CONTEXT_PACKETSIZE];
 
+    // Block read from the demuxer, packets are served from here
+    uint64_t av_cache_pos;
+    size_t av_cache_len;
+    unsigned char av_cache[AV_CONTEXT_CACHESIZE];
+
     // TS Streams context
     bool is_configured;
     uint16_t channel;
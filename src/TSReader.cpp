@@ -52,6 +52,27 @@ bool TSReader::ReadAV(uint64_t pos, unsigned char * data, size_t len)
   return AP4_SUCCEEDED(m_stream->Read(data, len));
 }
 
+size_t TSReader::ReadAVBlock(uint64_t pos, unsigned char * data, size_t len, size_t maxLen)
+{
+  m_stream->Seek(pos);
+  // Wait for the requested packet only, take whatever follows it for free
+  size_t dataSize(0);
+  while (dataSize < len)
+  {
+    size_t bytesRead(ReadAvailable(data + dataSize, maxLen - dataSize));
+    if (!bytesRead)
+      return 0;
+    dataSize += bytesRead;
+  }
+  return dataSize;
+}
+
+size_t TSReader::ReadAvailable(unsigned char * data, size_t maxLen)
+{
+  AP4_Size bytesRead;
+  return AP4_SUCCEEDED(m_stream->ReadPartial(data, static_cast<AP4_Size>(maxLen), bytesRead)) ? bytesRead : 0;
+}
+
 void TSReader::Reset(bool resetPackets)
 {
   m_stream->Tell(m_startPos);
@@ -318,6 +339,7 @@ bool TSReader::HandleStreamChange(uint16_t pid)
     {
       tsInfo.m_needInfo = false;
       tsInfo.m_changed = true;
+      OnStreamInfoChanged();
     }
     else if (tsInfo.m_needInfo)
       ret = false;
@@ -35,6 +35,7 @@ public:
   bool Initialize();
 
   virtual bool ReadAV(uint64_t pos, unsigned char * data, size_t len) override;
+  virtual size_t ReadAVBlock(uint64_t pos, unsigned char * data, size_t len, size_t maxLen) override;
 
   void Reset(bool resetPackets = true);
   bool StartStreaming(AP4_UI32 typeMask);
@@ -50,6 +51,12 @@ public:
   const AP4_Size GetPacketSize() const { return m_pkt.size; };
   const INPUTSTREAM_INFO::STREAM_TYPE GetStreamType() const;
 
+protected:
+  // Called when the demuxer delivers new properties for one of the streams
+  virtual void OnStreamInfoChanged() {};
+  // Reads at least one and up to maxLen bytes at the current position, returns 0 on failure
+  virtual size_t ReadAvailable(unsigned char *data, size_t maxLen);
+
 private:
   bool GetPacket();
   bool HandleProgramChange();
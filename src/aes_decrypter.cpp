@@ -19,21 +19,43 @@
 #include "aes_decrypter.h"
 #include "Ap4Protection.h"
 
-void AESDecrypter::decrypt(const AP4_UI08 *aes_key, const AP4_UI08 *aes_iv, const AP4_UI08 *src, AP4_UI08 *dst, size_t dataSize)
+static const size_t MAX_CACHED_CIPHERS = 16;
+
+std::shared_ptr<AP4_BlockCipher> AESDecrypter::getCipher(const AP4_UI08 *aes_key)
 {
-  AP4_BlockCipher* cbc_d_block_cipher;
-  AP4_DefaultBlockCipherFactory::Instance.CreateCipher(
+  std::lock_guard<std::mutex> lck(m_cipherMutex);
+
+  std::string key(reinterpret_cast<const char*>(aes_key), 16);
+  std::map<std::string, std::shared_ptr<AP4_BlockCipher> >::iterator res(m_ciphers.find(key));
+  if (res != m_ciphers.end())
+    return res->second;
+
+  // Streams with key rotation would grow the cache forever, start over.
+  // Ciphers still in use by other threads live on until they are done
+  if (m_ciphers.size() >= MAX_CACHED_CIPHERS)
+    m_ciphers.clear();
+
+  AP4_BlockCipher* cbc_d_block_cipher(nullptr);
+  if (AP4_FAILED(AP4_DefaultBlockCipherFactory::Instance.CreateCipher(
     AP4_BlockCipher::AES_128,
     AP4_BlockCipher::DECRYPT,
     AP4_BlockCipher::CBC,
     NULL,
     aes_key,
     16,
-    cbc_d_block_cipher);
+    cbc_d_block_cipher)))
+    return nullptr;
 
-  cbc_d_block_cipher->Process(src, dataSize, dst, aes_iv);
+  return m_ciphers[key] = std::shared_ptr<AP4_BlockCipher>(cbc_d_block_cipher);
+}
 
-  delete cbc_d_block_cipher;
+void AESDecrypter::decrypt(const AP4_UI08 *aes_key, const AP4_UI08 *aes_iv, const AP4_UI08 *src, AP4_UI08 *dst, size_t dataSize)
+{
+  // CBC ciphers keep no state between calls (the chaining block is
+  // passed in), so a cached cipher can be used without holding the lock
+  std::shared_ptr<AP4_BlockCipher> cbc_d_block_cipher(getCipher(aes_key));
+  if (cbc_d_block_cipher)
+    cbc_d_block_cipher->Process(src, dataSize, dst, aes_iv);
 }
 
 std::string AESDecrypter::convertIV(const std::string &input)
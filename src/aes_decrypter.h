@@ -19,8 +19,13 @@
 #pragma once
 
 #include "Ap4Types.h"
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 
+class AP4_BlockCipher;
+
 class AESDecrypter
 {
 public:
@@ -32,5 +37,10 @@ public:
   void ivFromSequence(uint8_t *buffer, uint64_t sid);
   const std::string &getLicenseKey() const { return m_licenseKey; };
 private:
+  std::shared_ptr<AP4_BlockCipher> getCipher(const AP4_UI08 *aes_key);
+
   std::string m_licenseKey;
+  // Expanded key schedules, one per key, shared by all download threads
+  std::mutex m_cipherMutex;
+  std::map<std::string, std::shared_ptr<AP4_BlockCipher> > m_ciphers;
 };
@@ -22,9 +22,17 @@
 #include <cstring>
 #include "../oscompat.h"
 #include <math.h>
+#include <algorithm>
+#include <chrono>
 
 using namespace adaptive;
 
+// Distance to the live edge we start live streams with
+static const unsigned int LIVE_DELAY_SECONDS = 12;
+static const unsigned int LOWLATENCY_LIVE_DELAY_SECONDS = 4;
+// Additional delay we accept (e.g. after stalls) before we skip segments to catch up
+static const unsigned int LIVE_DRIFT_TOLERANCE_SECONDS = 10;
+
 AdaptiveStream::AdaptiveStream(AdaptiveTree &tree, AdaptiveTree::StreamType type)
   :tree_(tree)
   , type_(type)
@@ -34,15 +42,23 @@ AdaptiveStream::AdaptiveStream(AdaptiveTree &tree, AdaptiveTree::StreamType type
   , current_rep_(nullptr)
   , current_seg_(nullptr)
   , loading_seg_(nullptr)
+  , next_period_(nullptr)
+  , next_adp_(nullptr)
+  , next_rep_(nullptr)
+  , prefetch_seg_(nullptr)
+  , prefetch_pending_(false)
+  , prefetch_done_(false)
+  , period_offset_(0)
   , thread_data_(nullptr)
   , segment_read_pos_(0)
   , start_PTS_(0)
+  , live_anchored_(false)
 {
 }
 
 AdaptiveStream::~AdaptiveStream()
 {
-  stop();
+  dispose();
   clear();
 }
 
@@ -56,46 +72,39 @@ void AdaptiveStream::ResetSegment()
     absolute_position_ = current_seg_->range_begin_;
 }
 
-bool AdaptiveStream::download_segment()
+void AdaptiveStream::get_download_url(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &strURL, std::string &range) const
 {
-  if (!current_seg_)
-    return false;
-
-  if (observer_ && current_seg_ != &current_rep_->initialization_)
-    observer_->OnSegmentChanged(this);
-
-  std::string strURL;
   char rangebuf[128], *rangeHeader(0);
 
-  if (!(current_rep_->flags_ & AdaptiveTree::Representation::SEGMENTBASE))
+  if (!(rep->flags_ & AdaptiveTree::Representation::SEGMENTBASE))
   {
-    if (!(current_rep_->flags_ & AdaptiveTree::Representation::TEMPLATE))
+    if (!(rep->flags_ & AdaptiveTree::Representation::TEMPLATE))
     {
-      if (current_rep_->flags_ & AdaptiveTree::Representation::URLSEGMENTS)
+      if (rep->flags_ & AdaptiveTree::Representation::URLSEGMENTS)
       {
-        strURL = current_seg_->url;
+        strURL = seg->url;
         if (strURL.find("://", 0) == std::string::npos)
-          strURL = current_rep_->url_ + strURL;
+          strURL = rep->url_ + strURL;
       }
       else
       {
-        strURL = current_rep_->url_;
-        sprintf(rangebuf, "bytes=%" PRIu64 "-%" PRIu64, current_seg_->range_begin_, current_seg_->range_end_);
+        strURL = rep->url_;
+        sprintf(rangebuf, "bytes=%" PRIu64 "-%" PRIu64, seg->range_begin_, seg->range_end_);
         rangeHeader = rangebuf;
       }
     }
-    else if (current_seg_ != &current_rep_->initialization_) //templated segment
+    else if (seg != &rep->initialization_) //templated segment
     {
-      std::string media = current_rep_->segtpl_.media;
+      std::string media = rep->segtpl_.media;
       std::string::size_type lenReplace(7);
       std::string::size_type np(media.find("$Number"));
-      uint64_t value(current_seg_->range_end_); //StartNumber
+      uint64_t value(seg->range_end_); //StartNumber
 
       if (np == std::string::npos)
       {
         lenReplace = 5;
         np = media.find("$Time");
-        value = current_seg_->range_begin_; //Timestamp
+        value = seg->range_begin_; //Timestamp
       }
       np += lenReplace;
 
@@ -112,26 +121,136 @@ bool AdaptiveStream::download_segment()
       strURL = media;
     }
     else //templated initialization segment
-      strURL = current_rep_->url_;
+      strURL = rep->url_;
   }
   else
   {
-    strURL = current_rep_->url_;
-    sprintf(rangebuf, "bytes=%" PRIu64 "-%" PRIu64, current_seg_->range_begin_, current_seg_->range_end_);
+    strURL = rep->url_;
+    sprintf(rangebuf, "bytes=%" PRIu64 "-%" PRIu64, seg->range_begin_, seg->range_end_);
     rangeHeader = rangebuf;
   }
 
   if (rangeHeader)
-    media_headers_["Range"] = rangeHeader;
+    range = rangeHeader;
+  else
+    range.clear();
+}
+
+void AdaptiveStream::prepare_download(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &strURL)
+{
+  std::string range;
+  get_download_url(rep, seg, strURL, range);
+  if (!range.empty())
+    media_headers_["Range"] = range;
   else
     media_headers_.erase("Range");
+}
+
+std::string AdaptiveStream::getInitKey(const AdaptiveTree::Representation *rep) const
+{
+  const AdaptiveTree::Segment *seg(rep ? rep->get_initialization() : nullptr);
+  if (!seg)
+    return std::string();
+
+  std::string strURL, range;
+  get_download_url(rep, seg, strURL, range);
+  return range.empty() ? strURL : strURL + "@" + range;
+}
 
-  if (download(strURL.c_str(), media_headers_))
+bool AdaptiveStream::load_init_segment(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &buffer)
+{
+  if (seg != rep->get_initialization())
+    return false;
+
+  std::string data;
+  if (!tree_.GetInitSegment(getInitKey(rep), data))
+    return false;
   {
+    std::lock_guard<std::mutex> lckrw(thread_data_->mutex_rw_);
+    buffer += data;
+  }
+  thread_data_->signal_rw_.notify_one();
+  return true;
+}
+
+bool AdaptiveStream::download_segment()
+{
+  if (!current_seg_)
+    return false;
+
+  if (observer_ && current_seg_ != &current_rep_->initialization_)
+    observer_->OnSegmentChanged(this);
+
+  // Init segments already seen by any stream of this tree are served from memory
+  if (!load_init_segment(current_rep_, current_seg_, segment_buffer_))
+  {
+    std::string strURL;
+    prepare_download(current_rep_, current_seg_, strURL);
+
+    size_t segmentStart(segment_buffer_.size());
+    std::string partURL;
+    if (tree_.GetSegmentPart(current_rep_, current_seg_, 0, partURL))
+    {
+      // Feed the parts to the reader as soon as they are published
+      unsigned int part(0);
+      do {
+        if (!download(partURL.c_str(), media_headers_))
+          return false;
+      } while (tree_.GetSegmentPart(current_rep_, current_seg_, ++part, partURL));
+    }
+    else if (!download(strURL.c_str(), media_headers_))
+      return false;
+
+    if (current_seg_ == current_rep_->get_initialization())
+    {
+      std::lock_guard<std::mutex> lckrw(thread_data_->mutex_rw_);
+      tree_.AddInitSegment(getInitKey(current_rep_), segment_buffer_.substr(segmentStart));
+    }
+  }
+
+  // Later periods continue the timeline of the first one (see period_offset_)
+  if (current_period_ == tree_.periods_[0])
     start_PTS_ = (current_rep_->segments_[0]->startPTS_ * current_rep_->timescale_ext_) / current_rep_->timescale_int_;
-    return true;
+  return true;
+}
+
+void AdaptiveStream::prefetch_next_period()
+{
+  prefetch_pending_ = false;
+
+  // SegmentBase indexes are parsed when we switch over
+  if (next_rep_->indexRangeMax_)
+    return;
+
+  const AdaptiveTree::Segment *segments[2] = { next_rep_->get_initialization(), next_rep_->get_next_segment(nullptr) };
+  if (!segments[1])
+    return;
+
+  std::string strURL;
+  for (unsigned int i(0); i < 2; ++i)
+  {
+    if (!segments[i] || load_init_segment(next_rep_, segments[i], prefetch_buffer_))
+      continue;
+
+    prepare_download(next_rep_, segments[i], strURL);
+    {
+      std::lock_guard<std::mutex> lckrw(thread_data_->mutex_rw_);
+      prefetch_seg_ = segments[i];
+    }
+    bool ret = download(strURL.c_str(), media_headers_) && !stopped_;
+    {
+      std::lock_guard<std::mutex> lckrw(thread_data_->mutex_rw_);
+      prefetch_seg_ = nullptr;
+    }
+    if (!ret)
+    {
+      prefetch_buffer_.clear();
+      return;
+    }
+    if (!i)
+      tree_.AddInitSegment(getInitKey(next_rep_), prefetch_buffer_);
   }
-  return false;
+  prefetch_done_ = true;
 }
 
 void AdaptiveStream::worker()
@@ -141,7 +260,26 @@ void AdaptiveStream::worker()
   do {
     thread_data_->signal_dl_.wait(lckdl);
 
-    bool ret  = download_segment();
+    // Don't ask the origin for live segments before they are published. Waiting releases
+    // mutex_dl_, a seek may replace the request meanwhile and we start over with the new one
+    const AdaptiveTree::Segment *requested;
+    do
+    {
+      requested = loading_seg_;
+      uint64_t availableTime(tree_.GetSegmentAvailableTime(current_rep_, current_seg_));
+      if (!availableTime)
+        break;
+      std::chrono::system_clock::time_point availableAt(std::chrono::milliseconds(static_cast<int64_t>(availableTime)));
+      std::chrono::system_clock::time_point now(std::chrono::system_clock::now());
+      while (now < availableAt && !stopped_ && !thread_data_->thread_stop_ && loading_seg_ == requested)
+      {
+        // stop() does not signal us, look at the flags at least every 100ms
+        thread_data_->signal_dl_.wait_for(lckdl, std::min<std::chrono::system_clock::duration>(availableAt - now, std::chrono::milliseconds(100)));
+        now = std::chrono::system_clock::now();
+      }
+    } while (loading_seg_ != requested && !stopped_ && !thread_data_->thread_stop_);
+
+    bool ret = !stopped_ && download_segment();
 
     //Signal finished download
     {
@@ -152,6 +290,10 @@ void AdaptiveStream::worker()
     }
     thread_data_->signal_rw_.notify_one();
 
+    // The reader still has the last segment of this period to consume
+    if (ret && prefetch_pending_)
+      prefetch_next_period();
+
   } while (!thread_data_->thread_stop_);
 }
 
@@ -163,6 +305,15 @@ bool AdaptiveStream::write_data(const void *buffer, size_t buffer_size)
     if (stopped_)
       return false;
 
+    if (prefetch_seg_)
+    {
+      size_t insertPos(prefetch_buffer_.size());
+      prefetch_buffer_.resize(insertPos + buffer_size);
+      tree_.OnDataArrived(const_cast<AdaptiveTree::Representation*>(next_rep_), prefetch_seg_,
+        reinterpret_cast<const uint8_t*>(buffer), reinterpret_cast<uint8_t*>(&prefetch_buffer_[0]), insertPos, buffer_size);
+      return true;
+    }
+
     size_t insertPos(segment_buffer_.size());
     segment_buffer_.resize(insertPos + buffer_size);
     tree_.OnDataArrived(const_cast<AdaptiveTree::Representation*>(current_rep_), current_seg_,
@@ -203,20 +354,18 @@ bool AdaptiveStream::prepare_stream(const AdaptiveTree::AdaptationSet *adp,
 
 bool AdaptiveStream::start_stream(const uint32_t seg_offset, uint16_t width, uint16_t height)
 {
-  if (!~seg_offset && tree_.has_timeshift_buffer_ && current_rep_->segments_.data.size()>1)
+  if (!~seg_offset && tree_.has_timeshift_buffer_ && current_rep_->segments_.size()>1)
   {
     std::int32_t pos;
     if (tree_.has_timeshift_buffer_ || tree_.available_time_>= tree_.stream_start_)
-      pos = static_cast<int32_t>(current_rep_->segments_.data.size() - 1);
+      pos = static_cast<int32_t>(current_rep_->segments_.size() - 1);
     else
     {
       pos = static_cast<int32_t>(((tree_.stream_start_ - tree_.available_time_)*current_rep_->timescale_) / current_rep_->duration_);
       if (!pos) pos = 1;
     }
-    //go at least 12 secs back
-    uint64_t duration(current_rep_->get_segment(pos)->startPTS_ - current_rep_->get_segment(pos - 1)->startPTS_);
-    pos -= static_cast<uint32_t>((12 * current_rep_->timescale_) / duration) + 1;
-    current_seg_ = current_rep_->get_segment(pos < 0 ? 0: pos);
+    current_seg_ = current_rep_->get_segment(getLiveSegmentPos(pos));
+    live_anchored_ = true;
   }
   else
     current_seg_ = ~seg_offset ? current_rep_->get_segment(seg_offset) : 0;
@@ -251,9 +400,32 @@ bool AdaptiveStream::start_stream(const uint32_t seg_offset, uint16_t width, uin
     thread_data_->signal_dl_.wait(lckdl);
   }
 
+  // Nothing downloads subtitle files through us, resolve their continuation right away
+  if (current_rep_->flags_ & AdaptiveTree::Representation::SUBTITLESTREAM)
+    resolve_next_period();
+
   return true;
 }
 
+uint32_t AdaptiveStream::getLiveDelay() const
+{
+  if (tree_.live_delay_)
+    return tree_.live_delay_;
+  //chunked low latency segments can be played closer to the edge
+  return current_rep_ && (current_rep_->flags_ & AdaptiveTree::Representation::CHUNKEDSEGMENTS)
+    ? LOWLATENCY_LIVE_DELAY_SECONDS : LIVE_DELAY_SECONDS;
+}
+
+std::uint32_t AdaptiveStream::getLiveSegmentPos(std::uint32_t edgePos) const
+{
+  // Sum up segment durations until we are getLiveDelay() behind the segment at edgePos
+  uint64_t delay(static_cast<uint64_t>(getLiveDelay()) * current_rep_->timescale_);
+  uint64_t edgePTS(current_rep_->get_segment(edgePos)->startPTS_);
+  while (edgePos && edgePTS - current_rep_->get_segment(edgePos)->startPTS_ < delay)
+    --edgePos;
+  return edgePos;
+}
+
 bool AdaptiveStream::restart_stream()
 {
   if (!start_stream(~0, width_, height_))
@@ -280,10 +452,10 @@ bool AdaptiveStream::ensureSegment()
     //wait until worker is reeady for new segment
     std::lock_guard<std::mutex> lck(thread_data_->mutex_dl_);
 
+    unsigned int segmentId(current_rep_->startNumber_ + current_rep_->get_segment_pos(current_seg_));
     tree_.RefreshSegments(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), current_seg_);
     if (~current_rep_->newStartNumber_)
     {
-      unsigned int segmentId(current_rep_->startNumber_ + current_rep_->get_segment_pos(current_seg_));
       adaptive::AdaptiveTree::Representation* rep(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_));
 
       rep->segments_.swap(rep->newSegments_);
@@ -293,12 +465,39 @@ bool AdaptiveStream::ensureSegment()
         segmentId = rep->startNumber_;
       current_seg_ = rep->get_segment(segmentId - rep->startNumber_);
     }
+    else if (current_seg_)
+      // Refresh may have trimmed the segment index far enough to release our entry
+      current_seg_ = current_rep_->get_segment(segmentId - current_rep_->startNumber_);
 
     current_seg_ = current_rep_->get_next_segment(current_seg_);
+
+    // Catch up with the live edge if we fell behind too far
+    if (current_seg_ && live_anchored_ && tree_.has_timeshift_buffer_ && current_rep_->segments_.size() > 1)
+    {
+      std::uint32_t edgePos(static_cast<std::uint32_t>(current_rep_->segments_.size() - 1));
+      uint64_t latency(current_rep_->get_segment(edgePos)->startPTS_ - current_seg_->startPTS_);
+      if (latency > static_cast<uint64_t>(getLiveDelay() + LIVE_DRIFT_TOLERANCE_SECONDS) * current_rep_->timescale_)
+      {
+        std::uint32_t livePos(getLiveSegmentPos(edgePos));
+        if (livePos > current_rep_->get_segment_pos(current_seg_))
+          current_seg_ = current_rep_->get_segment(livePos);
+      }
+    }
+
     if (current_seg_)
     {
+      // Load the next sub index before handing out the last known segment
+      if (!current_rep_->subIndexes_.empty() && !current_rep_->get_next_segment(current_seg_))
+      {
+        uint32_t segPos(current_rep_->get_segment_pos(current_seg_));
+        parseSubIndex();
+        current_seg_ = current_rep_->get_segment(segPos);
+      }
       loading_seg_ = current_seg_;
       ResetSegment();
+      // Last segment of this period, let the worker prefetch the following one
+      if (!next_rep_ && !current_rep_->get_next_segment(current_seg_) && resolve_next_period())
+        prefetch_pending_ = true;
       thread_data_->signal_dl_.notify_one();
     }
     else
@@ -311,7 +510,7 @@ bool AdaptiveStream::ensureSegment()
 }
 
 
-uint32_t AdaptiveStream::read(void* buffer, uint32_t  bytesToRead)
+uint32_t AdaptiveStream::read(void* buffer, uint32_t  bytesToRead, uint32_t minBytes)
 {
   std::unique_lock<std::mutex> lckrw(thread_data_->mutex_rw_);
 
@@ -321,7 +520,7 @@ NEXTSEGMENT:
     while (true)
     {
       uint32_t avail = segment_buffer_.size() - segment_read_pos_;
-      if (avail < bytesToRead && loading_seg_)
+      if (avail < minBytes && loading_seg_ && !stopped_)
       {
         thread_data_->signal_rw_.wait(lckrw);
         continue;
@@ -333,7 +532,7 @@ NEXTSEGMENT:
       segment_read_pos_ += avail;
       absolute_position_ += avail;
 
-      if (avail == bytesToRead)
+      if (avail && avail >= minBytes)
       {
         memcpy(buffer, segment_buffer_.data() + (segment_read_pos_ - avail), avail);
         return avail;
@@ -355,7 +554,7 @@ bool AdaptiveStream::seek(uint64_t const pos)
   {
     segment_read_pos_ = static_cast<uint32_t>(pos - (absolute_position_ - segment_read_pos_));
 
-    while (segment_read_pos_ > segment_buffer_.size() && loading_seg_)
+    while (segment_read_pos_ > segment_buffer_.size() && loading_seg_ && !stopped_)
       thread_data_->signal_rw_.wait(lckrw);
 
     if (segment_read_pos_ > segment_buffer_.size())
@@ -369,6 +568,37 @@ bool AdaptiveStream::seek(uint64_t const pos)
   return false;
 }
 
+bool AdaptiveStream::seek_period(double seek_seconds)
+{
+  if (!current_rep_ || !thread_data_ || tree_.periods_.size() < 2)
+    return false;
+
+  // Period starts on our timeline, later periods continue the first one (see period_offset_)
+  const AdaptiveTree::Period *target(tree_.periods_[0]);
+  for (std::vector<AdaptiveTree::Period*>::const_iterator bp(tree_.periods_.begin() + 1), ep(tree_.periods_.end()); bp != ep; ++bp)
+    if (static_cast<double>(start_PTS_) / 1000000 + static_cast<double>((*bp)->start_ - tree_.periods_[0]->start_) / 1000 <= seek_seconds)
+      target = *bp;
+
+  if (target == current_period_)
+    return false;
+
+  // A prefetched following period stays usable
+  if (target == next_period_)
+    return true;
+
+  //stop downloading chunks, the worker may be prefetching the following period
+  stopped_ = true;
+  std::lock_guard<std::mutex> lck(thread_data_->mutex_dl_);
+  stopped_ = false;
+  prefetch_buffer_.clear();
+  prefetch_pending_ = prefetch_done_ = false;
+  next_period_ = nullptr;
+  next_adp_ = nullptr;
+  next_rep_ = nullptr;
+
+  return resolve_period(target);
+}
+
 bool AdaptiveStream::seek_time(double seek_seconds, bool preceeding, bool &needReset)
 {
   if (!current_rep_ || stopped_)
@@ -379,12 +609,29 @@ bool AdaptiveStream::seek_time(double seek_seconds, bool preceeding, bool &needR
 
   uint32_t choosen_seg(~0);
 
+  // Targets in other periods are switched to before (see seek_period)
+  seek_seconds -= static_cast<double>(period_offset_) / 1000000;
+  if (seek_seconds < 0)
+    seek_seconds = 0;
+
   uint64_t sec_in_ts = static_cast<uint64_t>(seek_seconds * current_rep_->timescale_);
+
+  // Hierarchical SIDX: load the sub indexes up to the seek target
+  if (!current_rep_->subIndexes_.empty() && sec_in_ts >= current_rep_->subIndexes_.front().startPTS_)
+  {
+    //wait until the running download is done, loading may relocate the segments
+    std::lock_guard<std::mutex> lck(thread_data_->mutex_dl_);
+    uint32_t segPos(current_rep_->get_segment_pos(current_seg_));
+    while (!current_rep_->subIndexes_.empty() && sec_in_ts >= current_rep_->subIndexes_.front().startPTS_
+      && parseSubIndex());
+    current_seg_ = current_rep_->get_segment(segPos);
+  }
+
   choosen_seg = 0; //Skip initialization
-  while (choosen_seg < current_rep_->segments_.data.size() && sec_in_ts > current_rep_->get_segment(choosen_seg)->startPTS_)
+  while (choosen_seg < current_rep_->segments_.size() && sec_in_ts > current_rep_->get_segment(choosen_seg)->startPTS_)
     ++choosen_seg;
 
-  if (choosen_seg == current_rep_->segments_.data.size())
+  if (choosen_seg == current_rep_->segments_.size())
     return false;
 
   if (choosen_seg && current_rep_->get_segment(choosen_seg)->startPTS_ > sec_in_ts)
@@ -427,18 +674,15 @@ bool AdaptiveStream::seek_time(double seek_seconds, bool preceeding, bool &needR
   return false;
 }
 
-bool AdaptiveStream::select_stream(bool force, bool justInit, unsigned int repId)
+const AdaptiveTree::Representation *AdaptiveStream::choose_representation(const AdaptiveTree::AdaptationSet *adp, unsigned int repId) const
 {
   const AdaptiveTree::Representation *new_rep(0), *min_rep(0);
 
-  //if (force && absolute_position_ == 0) //already selected
-  //  return true;
-
-  if (!repId || repId > current_adp_->repesentations_.size())
+  if (!repId || repId > adp->repesentations_.size())
   {
     unsigned int bestScore(~0);
 
-    for (std::vector<AdaptiveTree::Representation*>::const_iterator br(current_adp_->repesentations_.begin()), er(current_adp_->repesentations_.end()); br != er; ++br)
+    for (std::vector<AdaptiveTree::Representation*>::const_iterator br(adp->repesentations_.begin()), er(adp->repesentations_.end()); br != er; ++br)
     {
       unsigned int score;
       if ((*br)->bandwidth_ <= bandwidth_ && (*br)->hdcpVersion_ <= hdcpVersion_
@@ -454,10 +698,134 @@ bool AdaptiveStream::select_stream(bool force, bool justInit, unsigned int repId
     }
   }
   else
-    new_rep = current_adp_->repesentations_[current_adp_->repesentations_.size() - repId];
+    new_rep = adp->repesentations_[adp->repesentations_.size() - repId];
+
+  return new_rep ? new_rep : min_rep;
+}
+
+bool AdaptiveStream::resolve_next_period()
+{
+  std::vector<AdaptiveTree::Period*>::const_iterator bp(std::find(tree_.periods_.begin(), tree_.periods_.end(), current_period_));
+  if (bp == tree_.periods_.end() || ++bp == tree_.periods_.end())
+    return false;
+  return resolve_period(*bp);
+}
+
+bool AdaptiveStream::resolve_period(const AdaptiveTree::Period *period)
+{
+  // Prefer the adaptation set continuing ours (same id), then same language and codecs
+  const AdaptiveTree::AdaptationSet *adp(0);
+  unsigned int bestScore(0);
+  for (std::vector<AdaptiveTree::AdaptationSet*>::const_iterator ba(period->adaptationSets_.begin()), ea(period->adaptationSets_.end()); ba != ea; ++ba)
+  {
+    if ((*ba)->type_ != current_adp_->type_ || (*ba)->repesentations_.empty())
+      continue;
+    unsigned int score(1);
+    if (!current_adp_->id.empty() && (*ba)->id == current_adp_->id)
+      score += 4;
+    if ((*ba)->language_ == current_adp_->language_)
+      score += 2;
+    if ((*ba)->codecs_ == current_adp_->codecs_)
+      score += 1;
+    if (score > bestScore)
+    {
+      bestScore = score;
+      adp = *ba;
+    }
+  }
+
+  if (!adp)
+    return false;
+
+  next_period_ = period;
+  next_adp_ = adp;
+  next_rep_ = choose_representation(adp, 0);
+  return next_rep_ != nullptr;
+}
+
+bool AdaptiveStream::start_next_period()
+{
+  if (!next_rep_ || !thread_data_)
+    return false;
+
+  // Wait until the worker has finished prefetching
+  std::lock_guard<std::mutex> lck(thread_data_->mutex_dl_);
+
+  tree_.SetRepresentationEnabled(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), false);
+
+  current_period_ = next_period_;
+  current_adp_ = next_adp_;
+  current_rep_ = next_rep_;
+  next_period_ = nullptr;
+  next_adp_ = nullptr;
+  next_rep_ = nullptr;
+
+  tree_.SetRepresentationEnabled(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), true);
+
+  segment_buffer_.clear();
+  segment_read_pos_ = 0;
+  stopped_ = false;
+
+  // Subtitle files are loaded by their reader, their times start with the period
+  if (current_rep_->flags_ & AdaptiveTree::Representation::SUBTITLESTREAM)
+  {
+    period_offset_ = static_cast<int64_t>(current_period_->start_ - tree_.periods_[0]->start_) * 1000 + static_cast<int64_t>(start_PTS_);
+    current_seg_ = nullptr;
+    resolve_next_period();
+    return true;
+  }
+
+  if (current_rep_->indexRangeMax_)
+  {
+    AdaptiveTree::Representation *rep(const_cast<AdaptiveTree::Representation *>(current_rep_));
+    if (!parseIndexRange())
+    {
+      stopped_ = true;
+      return false;
+    }
+    rep->indexRangeMin_ = rep->indexRangeMax_ = 0;
+  }
+
+  const AdaptiveTree::Segment *firstSeg(current_rep_->get_next_segment(nullptr));
+  if (!firstSeg)
+  {
+    stopped_ = true;
+    return false;
+  }
+
+  // Shift this period's timestamps so that they continue the previous period
+  period_offset_ = static_cast<int64_t>(current_period_->start_ - tree_.periods_[0]->start_) * 1000 + static_cast<int64_t>(start_PTS_)
+    - static_cast<int64_t>((firstSeg->startPTS_ * current_rep_->timescale_ext_) / current_rep_->timescale_int_);
+
+  if (prefetch_done_)
+    segment_buffer_.swap(prefetch_buffer_);
+  else
+  {
+    // Nothing prefetched (e.g. we seeked into the last segment), load the start synchronously
+    if ((current_seg_ = current_rep_->get_initialization()) && !download_segment())
+    {
+      stopped_ = true;
+      return false;
+    }
+    if (!(current_seg_ = firstSeg) || !download_segment())
+    {
+      stopped_ = true;
+      return false;
+    }
+  }
+  current_seg_ = firstSeg;
+  prefetch_buffer_.clear();
+  prefetch_pending_ = prefetch_done_ = false;
+
+  return true;
+}
+
+bool AdaptiveStream::select_stream(bool force, bool justInit, unsigned int repId)
+{
+  const AdaptiveTree::Representation *new_rep(choose_representation(current_adp_, repId));
 
-  if (!new_rep)
-    new_rep = min_rep;
+  //if (force && absolute_position_ == 0) //already selected
+  //  return true;
 
   if (justInit)
   {
@@ -470,11 +838,11 @@ bool AdaptiveStream::select_stream(bool force, bool justInit, unsigned int repId
 
   uint32_t segid(current_rep_ ? current_rep_->get_segment_pos(current_seg_) : 0);
   if (current_rep_)
-    const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_)->flags_ &= ~adaptive::AdaptiveTree::Representation::ENABLED;
+    tree_.SetRepresentationEnabled(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), false);
 
   current_rep_ = new_rep;
 
-  const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_)->flags_ |= adaptive::AdaptiveTree::Representation::ENABLED;
+  tree_.SetRepresentationEnabled(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), true);
 
   if (observer_)
     observer_->OnStreamChange(this, segid);
@@ -510,9 +878,22 @@ void AdaptiveStream::info(std::ostream &s)
 
 void AdaptiveStream::stop()
 {
-  stopped_ = true;
+  if (thread_data_)
+  {
+    // Wake up readers waiting for data, they return once they see stopped_
+    std::lock_guard<std::mutex> lckrw(thread_data_->mutex_rw_);
+    stopped_ = true;
+    thread_data_->signal_rw_.notify_all();
+  }
+  else
+    stopped_ = true;
   if (current_rep_)
-    const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_)->flags_ &= ~adaptive::AdaptiveTree::Representation::ENABLED;
+    tree_.SetRepresentationEnabled(const_cast<adaptive::AdaptiveTree::Representation*>(current_rep_), false);
+};
+
+void AdaptiveStream::dispose()
+{
+  stop();
   if (thread_data_)
   {
     delete thread_data_;
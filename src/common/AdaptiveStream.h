@@ -51,6 +51,8 @@ namespace adaptive
     bool restart_stream();
     bool select_stream(bool force = false, bool justInit = false, unsigned int repId = 0);
     void stop();
+    // Also joins the download thread, no reader may be inside read() / seek() anymore
+    void dispose();
     void clear();
     void info(std::ostream &s);
     unsigned int getWidth() const { return width_; };
@@ -60,25 +62,47 @@ namespace adaptive
     unsigned int get_type()const{ return type_; };
 
     bool ensureSegment();
-    uint32_t read(void* buffer, uint32_t  bytesToRead);
+    uint32_t read(void* buffer, uint32_t  bytesToRead) { return read(buffer, bytesToRead, bytesToRead); };
+    // Reads up to bytesToRead bytes but waits for the download only until minBytes are available
+    uint32_t read(void* buffer, uint32_t  bytesToRead, uint32_t minBytes);
     uint64_t tell(){ read(0, 0);  return absolute_position_; };
     bool seek(uint64_t const pos);
+    // Selects the period containing seek_seconds as next period, true if start_next_period has to switch to it
+    bool seek_period(double seek_seconds);
     bool seek_time(double seek_seconds, bool preceeding, bool &needReset);
     AdaptiveTree::AdaptationSet const *getAdaptationSet() { return current_adp_; };
     AdaptiveTree::Representation const *getRepresentation(){ return current_rep_; };
     double get_download_speed() const { return tree_.get_download_speed(); };
     void set_download_speed(double speed) { tree_.set_download_speed(speed); };
     size_t getSegmentPos() { return current_rep_->segments_.pos(current_seg_); };
-    uint64_t GetPTSOffset() { return current_seg_ ? (current_seg_->startPTS_ * current_rep_->timescale_ext_) / current_rep_->timescale_int_ : 0; };
+    AdaptiveTree::Segment const *getSegment() { return current_seg_; };
+    uint64_t GetPTSOffset() { return current_seg_ ? (current_seg_->startPTS_ * current_rep_->timescale_ext_) / current_rep_->timescale_int_ + period_offset_ : 0; };
+    // Timestamps of the current period are shifted by this value to continue the previous periods
+    int64_t GetPeriodOffset() const { return period_offset_; };
+    bool has_next_period() const { return next_rep_ != nullptr; };
+    // Identifies the init segment of a representation by url and byte range, empty if there is none
+    std::string getInitKey(const AdaptiveTree::Representation *rep) const;
+    bool start_next_period();
     uint64_t GetStartPTS() const { return start_PTS_; };
+    uint32_t getLiveDelay() const;
+    void set_live_anchored(bool anchored) { live_anchored_ = anchored; };
   protected:
     virtual bool download(const char* url, const std::map<std::string, std::string> &mediaHeaders){ return false; };
     virtual bool parseIndexRange() { return false; };
+    virtual bool parseSubIndex() { return false; };
     bool write_data(const void *buffer, size_t buffer_size);
   private:
     // Segment download section
     void ResetSegment();
+    std::uint32_t getLiveSegmentPos(std::uint32_t edgePos) const;
+    const AdaptiveTree::Representation *choose_representation(const AdaptiveTree::AdaptationSet *adp, unsigned int repId) const;
+    bool resolve_next_period();
+    bool resolve_period(const AdaptiveTree::Period *period);
+    void get_download_url(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &strURL, std::string &range) const;
+    void prepare_download(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &strURL);
+    bool load_init_segment(const AdaptiveTree::Representation *rep, const AdaptiveTree::Segment *seg, std::string &buffer);
     bool download_segment();
+    void prefetch_next_period();
     void worker();
 
     struct THREADDATA
@@ -115,6 +139,15 @@ namespace adaptive
     const AdaptiveTree::AdaptationSet *current_adp_;
     const AdaptiveTree::Representation *current_rep_;
     const AdaptiveTree::Segment *current_seg_, *loading_seg_;
+    // Matching stream in the following period, its init and first segment are
+    // prefetched while the last segment of the current period downloads
+    const AdaptiveTree::Period *next_period_;
+    const AdaptiveTree::AdaptationSet *next_adp_;
+    const AdaptiveTree::Representation *next_rep_;
+    const AdaptiveTree::Segment *prefetch_seg_;
+    std::string prefetch_buffer_;
+    bool prefetch_pending_, prefetch_done_;
+    int64_t period_offset_;
     //We assume that a single segment can build complete frames
     std::string segment_buffer_;
     std::map<std::string, std::string> media_headers_;
@@ -127,5 +160,7 @@ namespace adaptive
     uint32_t hdcpLimit_;
     uint16_t hdcpVersion_;
     bool stopped_;
+    // Playback follows the live edge, we may skip segments to stay there
+    bool live_anchored_;
   };
 };
@@ -20,10 +20,18 @@
 #include <string.h>
 #include <algorithm>
 #include <stdlib.h>
+#include <stdio.h>
+#include <functional>
 #include "../log.h"
 
 namespace adaptive
 {
+  static const size_t MAX_MANIFEST_VALIDATORS = 32;
+  // Manifest snapshots are stored in a fixed number of files, selected by url hash
+  static const unsigned int MAX_MANIFEST_SNAPSHOTS = 8;
+  static const uint32_t SNAPSHOT_MAGIC = 0x50534149; //"IASP"
+  static const uint32_t SNAPSHOT_VERSION = 2;
+
   void AdaptiveTree::Segment::SetRange(const char *range)
   {
     const char *delim(strchr(range, '-'));
@@ -49,6 +57,10 @@ namespace adaptive
     , base_time_(0)
     , minPresentationOffset(0)
     , has_timeshift_buffer_(false)
+    , is_static_(false)
+    , live_delay_(0)
+    , timeshift_buffer_depth_(0)
+    , clock_offset_(0)
     , download_speed_(0.0)
     , average_download_speed_(0.0f)
     , encryptionState_(ENCRYTIONSTATE_UNENCRYPTED)
@@ -60,14 +72,18 @@ namespace adaptive
 
   AdaptiveTree::~AdaptiveTree()
   {
+    if (refresh_state_.modified_ || refresh_state_.notModified_)
+      Log(LOGLEVEL_DEBUG, "Manifest refreshes: %u modified, %u not modified, %" PRIu64 " bytes saved",
+        refresh_state_.modified_, refresh_state_.notModified_, refresh_state_.bytesSaved_);
+
     for (std::vector<Period*>::const_iterator bp(periods_.begin()), ep(periods_.end()); bp != ep; ++bp)
       for (std::vector<AdaptationSet*>::const_iterator ba((*bp)->adaptationSets_.begin()), ea((*bp)->adaptationSets_.end()); ba != ea; ++ba)
         for (std::vector<Representation*>::const_iterator br((*ba)->repesentations_.begin()), er((*ba)->repesentations_.end()); br != er; ++br)
           if ((*br)->flags_ & Representation::URLSEGMENTS)
           {
-            for (std::vector<Segment>::iterator bs((*br)->segments_.data.begin()), es((*br)->segments_.data.end()); bs != es; ++bs)
+            for (STABLEVECTOR<Segment>::iterator bs((*br)->segments_.data.begin()), es((*br)->segments_.data.end()); bs != es; ++bs)
               delete[] bs->url;
-            for (std::vector<Segment>::iterator bs((*br)->newSegments_.data.begin()), es((*br)->newSegments_.data.end()); bs != es; ++bs)
+            for (STABLEVECTOR<Segment>::iterator bs((*br)->newSegments_.data.begin()), es((*br)->newSegments_.data.end()); bs != es; ++bs)
               delete[] bs->url;
             if((*br)->flags_ & Representation::INITIALIZATION)
               delete[] (*br)->initialization_.url;
@@ -102,20 +118,45 @@ namespace adaptive
       average_download_speed_ = average_download_speed_*0.9 + download_speed_*0.1;
   };
 
-  void AdaptiveTree::SetFragmentDuration(const AdaptationSet* adp, const Representation* rep, size_t pos, uint64_t timestamp, uint32_t fragmentDuration, uint32_t movie_timescale)
+  bool AdaptiveTree::GetInitSegment(const std::string &key, std::string &data)
+  {
+    std::lock_guard<std::mutex> lck(m_mutex);
+
+    std::map<std::string, std::string>::const_iterator res(init_segments_.find(key));
+    if (key.empty() || res == init_segments_.end())
+      return false;
+    data = res->second;
+    return true;
+  }
+
+  void AdaptiveTree::AddInitSegment(const std::string &key, const std::string &data)
+  {
+    std::lock_guard<std::mutex> lck(m_mutex);
+
+    if (!key.empty() && !data.empty())
+      init_segments_[key] = data;
+  }
+
+  void AdaptiveTree::SetFragmentDuration(const AdaptationSet* adp, const Representation* rep, const Segment* segment, uint64_t timestamp, uint32_t fragmentDuration, uint32_t movie_timescale)
   {
     if (!has_timeshift_buffer_ || (rep->flags_ & AdaptiveTree::Representation::URLSEGMENTS) != 0)
       return;
 
+    // Resolve the segment under the lock, a refresh may have trimmed it meanwhile
+    std::lock_guard<std::mutex> lck(m_segmentMutex);
+    size_t pos(rep->segments_.pos(segment));
+    if (pos == ~0U)
+      return;
+
     //Get a modifiable adaptationset
     AdaptationSet *adpm(const_cast<AdaptationSet *>(adp));
 
     // Check if its the last frame we watch
-    if (adp->segment_durations_.data.size())
+    if (adp->segment_durations_.size())
     {
-      if (pos == adp->segment_durations_.data.size() - 1)
+      if (pos == adp->segment_durations_.size() - 1)
       {
-        adpm->segment_durations_.insert(static_cast<std::uint64_t>(fragmentDuration)*adp->timescale_ / movie_timescale);
+        adpm->segment_durations_.append(static_cast<std::uint64_t>(fragmentDuration)*adp->timescale_ / movie_timescale);
       }
       else
       {
@@ -123,7 +164,7 @@ namespace adaptive
         return;
       }
     }
-    else if (pos != rep->segments_.data.size() - 1)
+    else if (pos != rep->segments_.size() - 1)
       return;
 
     Segment seg(*(rep->segments_[pos]));
@@ -138,7 +179,68 @@ namespace adaptive
     seg.range_end_ ++;
 
     for (std::vector<Representation*>::iterator b(adpm->repesentations_.begin()), e(adpm->repesentations_.end()); b != e; ++b)
-      (*b)->segments_.insert(seg);
+      (*b)->segments_.append(seg);
+
+    // Drop what left the timeshift buffer, but never the segment we are playing
+    size_t expired(GetExpiredSegments(rep, pos, 1));
+    if (expired)
+    {
+      for (std::vector<Representation*>::iterator b(adpm->repesentations_.begin()), e(adpm->repesentations_.end()); b != e; ++b)
+        TrimSegments(*b, expired);
+      if (!adp->segment_durations_.empty())
+        adpm->segment_durations_.trim(expired);
+    }
+  }
+
+  size_t AdaptiveTree::GetExpiredSegments(const Representation *rep, size_t maxCount, size_t appendCount) const
+  {
+    // Without a known timeshift buffer depth we keep the window size of the first manifest
+    if (!timeshift_buffer_depth_ || !rep->timescale_)
+      return appendCount < maxCount ? appendCount : maxCount;
+
+    if (rep->segments_.empty())
+      return 0;
+
+    uint64_t window(static_cast<uint64_t>(timeshift_buffer_depth_) * rep->timescale_);
+    uint64_t edgePTS(rep->segments_[static_cast<uint32_t>(rep->segments_.size() - 1)]->startPTS_);
+    size_t count(0);
+    while (count < maxCount && edgePTS - rep->segments_[static_cast<uint32_t>(count)]->startPTS_ > window)
+      ++count;
+    return count;
+  }
+
+  void AdaptiveTree::TrimSegments(Representation *rep, size_t count)
+  {
+    if (count > rep->segments_.size())
+      count = rep->segments_.size();
+
+    if (rep->flags_ & Representation::URLSEGMENTS)
+      for (size_t i(0); i < count; ++i)
+      {
+        Segment *seg(const_cast<Segment*>(rep->segments_[static_cast<uint32_t>(i)]));
+        delete[] seg->url;
+        seg->url = nullptr;
+      }
+
+    rep->segments_.trim(count);
+    rep->startNumber_ += static_cast<unsigned int>(count);
+    rep->expired_segments_ = rep->expired_segments_ > count ? rep->expired_segments_ - static_cast<uint32_t>(count) : 0;
+  }
+
+  void AdaptiveTree::UpdateValidator(const char* url, const MANIFESTVALIDATOR &validator)
+  {
+    std::lock_guard<std::mutex> lck(m_mutex);
+
+    ++refresh_state_.modified_;
+    if (validator.etag_.empty() && validator.lastModified_.empty())
+    {
+      refresh_state_.validators_.erase(url);
+      return;
+    }
+    // Changing urls (e.g. start numbers) must not let the map grow forever
+    if (refresh_state_.validators_.size() >= MAX_MANIFEST_VALIDATORS && refresh_state_.validators_.find(url) == refresh_state_.validators_.end())
+      refresh_state_.validators_.erase(refresh_state_.validators_.begin());
+    refresh_state_.validators_[url] = validator;
   }
 
   void AdaptiveTree::OnDataArrived(Representation *rep, const Segment *seg, const uint8_t *src, uint8_t *dst, size_t dstOffset, size_t dataSize)
@@ -237,4 +339,413 @@ namespace adaptive
     }
   }
 
+  /*----------------------------------------------------------------------
+  |   manifest snapshots
+  +---------------------------------------------------------------------*/
+  /* Layout: magic, version, checksum of the payload, payload.
+     Payload starts with manifest url, key system and validators, followed
+     by the tree. Vectors of plain structs (segments, durations) are stored
+     as one block, so loading a snapshot is mostly a few memcpy's. */
+
+  static std::string GetSnapshotFile(const std::string &path, const std::string &url)
+  {
+    char name[32];
+    sprintf(name, "manifest%u.bin", static_cast<unsigned int>(std::hash<std::string>()(url) % MAX_MANIFEST_SNAPSHOTS));
+    return path + name;
+  }
+
+  static uint32_t GetSnapshotChecksum(const char *data, size_t size)
+  {
+    //FNV-1a
+    uint32_t hash(2166136261U);
+    for (; size; --size, ++data)
+      hash = (hash ^ static_cast<uint8_t>(*data)) * 16777619U;
+    return hash;
+  }
+
+  template<typename T> static void WriteSnapshot(std::string &buf, const T &value)
+  {
+    buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  static void WriteSnapshot(std::string &buf, const std::string &value)
+  {
+    WriteSnapshot(buf, static_cast<uint32_t>(value.size()));
+    buf += value;
+  }
+
+  template<typename T> static void WriteSnapshot(std::string &buf, const STABLEVECTOR<T> &value)
+  {
+    WriteSnapshot(buf, static_cast<uint32_t>(value.size()));
+    for (typename STABLEVECTOR<T>::const_iterator b(value.begin()), e(value.end()); b != e; ++b)
+      buf.append(reinterpret_cast<const char*>(&*b), sizeof(T));
+  }
+
+  static void WriteSnapshot(std::string &buf, const std::vector<AdaptiveTree::Segment> &value)
+  {
+    WriteSnapshot(buf, static_cast<uint32_t>(value.size()));
+    if (!value.empty())
+      buf.append(reinterpret_cast<const char*>(value.data()), value.size() * sizeof(AdaptiveTree::Segment));
+  }
+
+  static void WriteSnapshot(std::string &buf, const AdaptiveTree::SegmentTemplate &tpl)
+  {
+    WriteSnapshot(buf, tpl.initialization);
+    WriteSnapshot(buf, tpl.media);
+    WriteSnapshot(buf, tpl.timescale);
+    WriteSnapshot(buf, tpl.duration);
+    WriteSnapshot(buf, tpl.presentationTimeOffset);
+    WriteSnapshot(buf, tpl.availabilityTimeOffset);
+    WriteSnapshot(buf, tpl.availabilityTimeComplete);
+  }
+
+  struct SNAPSHOTREADER
+  {
+    SNAPSHOTREADER(const std::string &data) :pos_(data.data()), end_(data.data() + data.size()) {};
+
+    bool Read(void *dst, size_t size)
+    {
+      if (static_cast<size_t>(end_ - pos_) < size)
+        return false;
+      memcpy(dst, pos_, size);
+      pos_ += size;
+      return true;
+    }
+
+    template<typename T> bool Read(T &value) { return Read(&value, sizeof(T)); }
+
+    bool Read(std::string &value)
+    {
+      uint32_t size;
+      if (!Read(size) || static_cast<size_t>(end_ - pos_) < size)
+        return false;
+      value.assign(pos_, size);
+      pos_ += size;
+      return true;
+    }
+
+    template<typename T> bool Read(STABLEVECTOR<T> &value)
+    {
+      uint32_t size;
+      if (!Read(size) || static_cast<size_t>(end_ - pos_) / sizeof(T) < size)
+        return false;
+      value.resize(size);
+      for (typename STABLEVECTOR<T>::iterator b(value.begin()), e(value.end()); b != e; ++b)
+        Read(&*b, sizeof(T));
+      return true;
+    }
+
+    bool Read(std::vector<AdaptiveTree::Segment> &value)
+    {
+      uint32_t size;
+      if (!Read(size) || static_cast<size_t>(end_ - pos_) / sizeof(AdaptiveTree::Segment) < size)
+        return false;
+      value.resize(size);
+      return !size || Read(value.data(), size * sizeof(AdaptiveTree::Segment));
+    }
+
+    bool Read(AdaptiveTree::SegmentTemplate &tpl)
+    {
+      return Read(tpl.initialization) && Read(tpl.media) && Read(tpl.timescale) && Read(tpl.duration)
+        && Read(tpl.presentationTimeOffset) && Read(tpl.availabilityTimeOffset) && Read(tpl.availabilityTimeComplete);
+    }
+
+    // Url of URLSEGMENTS segments, stored behind the segment block
+    bool ReadUrl(AdaptiveTree::Segment &seg)
+    {
+      std::string url;
+      seg.url = nullptr;
+      if (!Read(url))
+        return false;
+      char *dst(new char[url.size() + 1]);
+      memcpy(dst, url.c_str(), url.size() + 1);
+      seg.url = dst;
+      return true;
+    }
+
+    bool ReadHeader(std::string &url, std::string &keySystem, AdaptiveTree::MANIFESTVALIDATOR &validator)
+    {
+      uint32_t magic, version, segmentSize, checksum;
+      if (!Read(magic) || magic != SNAPSHOT_MAGIC || !Read(version) || version != SNAPSHOT_VERSION
+        || !Read(checksum) || GetSnapshotChecksum(pos_, end_ - pos_) != checksum
+        || !Read(segmentSize) || segmentSize != sizeof(AdaptiveTree::Segment))
+        return false;
+      return Read(url) && Read(keySystem) && Read(validator.etag_) && Read(validator.lastModified_) && Read(validator.size_);
+    }
+
+    const char *pos_, *end_;
+  };
+
+  bool AdaptiveTree::ReadSnapshot(std::string &snapshot)
+  {
+    if (snapshot_path_.empty())
+      return false;
+
+    FILE *f(fopen(GetSnapshotFile(snapshot_path_, manifest_url_).c_str(), "rb"));
+    if (!f)
+      return false;
+
+    long size(0);
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+      snapshot.resize(static_cast<size_t>(size));
+      if (fread(&snapshot[0], 1, snapshot.size(), f) != snapshot.size())
+        snapshot.clear();
+    }
+    fclose(f);
+
+    std::string url, keySystem;
+    MANIFESTVALIDATOR validator;
+    SNAPSHOTREADER reader(snapshot);
+    if (snapshot.empty() || !reader.ReadHeader(url, keySystem, validator) || url != manifest_url_ || keySystem != supportedKeySystem_)
+    {
+      snapshot.clear();
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lck(m_mutex);
+    refresh_state_.validators_[manifest_url_] = validator;
+    return true;
+  }
+
+  bool AdaptiveTree::LoadSnapshot(const std::string &snapshot)
+  {
+    for (std::vector<Period*>::const_iterator bp(periods_.begin()), ep(periods_.end()); bp != ep; ++bp)
+      delete *bp;
+    periods_.clear();
+    current_period_ = nullptr;
+    psshSets_.clear();
+
+    std::string url, keySystem;
+    MANIFESTVALIDATOR validator;
+    SNAPSHOTREADER reader(snapshot);
+    uint32_t periodCount, psshCount;
+
+    bool ok = reader.ReadHeader(url, keySystem, validator)
+      && reader.Read(overallSeconds_) && reader.Read(stream_start_) && reader.Read(available_time_)
+      && reader.Read(publish_time_) && reader.Read(base_time_) && reader.Read(minPresentationOffset)
+      && reader.Read(encryptionState_) && reader.Read(included_types_) && reader.Read(need_secure_decoder_)
+      && reader.Read(license_url_) && reader.Read(psshCount);
+
+    for (uint32_t i(0); ok && i < psshCount; ++i)
+    {
+      psshSets_.push_back(PSSH());
+      PSSH &pssh(psshSets_.back());
+      ok = reader.Read(pssh.pssh_) && reader.Read(pssh.defaultKID_) && reader.Read(pssh.iv)
+        && reader.Read(pssh.media_) && reader.Read(pssh.use_count_);
+    }
+
+    ok = ok && reader.Read(periodCount);
+    for (uint32_t i(0); ok && i < periodCount; ++i)
+    {
+      Period *period(new Period());
+      periods_.push_back(period);
+
+      uint32_t adpCount;
+      ok = reader.Read(period->base_url_) && reader.Read(period->duration_) && reader.Read(period->timescale_)
+        && reader.Read(period->startPTS_) && reader.Read(period->start_) && reader.Read(period->length_)
+        && reader.Read(period->startNumber_) && reader.Read(period->segment_durations_.data)
+        && reader.Read(period->segtpl_) && reader.Read(adpCount);
+
+      for (uint32_t j(0); ok && j < adpCount; ++j)
+      {
+        AdaptationSet *adp(new AdaptationSet());
+        period->adaptationSets_.push_back(adp);
+
+        uint32_t repCount;
+        ok = reader.Read(adp->type_) && reader.Read(adp->timescale_) && reader.Read(adp->duration_)
+          && reader.Read(adp->startPTS_) && reader.Read(adp->startNumber_) && reader.Read(adp->impaired_)
+          && reader.Read(adp->language_) && reader.Read(adp->mimeType_) && reader.Read(adp->base_url_)
+          && reader.Read(adp->id) && reader.Read(adp->codecs_) && reader.Read(adp->segment_durations_.data)
+          && reader.Read(adp->segtpl_) && reader.Read(repCount);
+
+        for (uint32_t k(0); ok && k < repCount; ++k)
+        {
+          Representation *rep(new Representation());
+          adp->repesentations_.push_back(rep);
+
+          ok = reader.Read(rep->url_) && reader.Read(rep->id) && reader.Read(rep->codecs_)
+            && reader.Read(rep->codec_private_data_) && reader.Read(rep->source_url_)
+            && reader.Read(rep->bandwidth_) && reader.Read(rep->samplingRate_) && reader.Read(rep->width_)
+            && reader.Read(rep->height_) && reader.Read(rep->fpsRate_) && reader.Read(rep->fpsScale_)
+            && reader.Read(rep->aspect_) && reader.Read(rep->hdcpVersion_) && reader.Read(rep->indexRangeMin_)
+            && reader.Read(rep->indexRangeMax_) && reader.Read(rep->channelCount_) && reader.Read(rep->nalLengthSize_)
+            && reader.Read(rep->pssh_set_) && reader.Read(rep->expired_segments_) && reader.Read(rep->containerType_)
+            && reader.Read(rep->segtpl_) && reader.Read(rep->startNumber_) && reader.Read(rep->nextPts_)
+            && reader.Read(rep->duration_) && reader.Read(rep->timescale_)
+            && reader.Read(rep->initialization_) && reader.Read(rep->segments_.data) && reader.Read(rep->subIndexes_)
+            && reader.Read(rep->flags_);
+
+          if (ok && (rep->flags_ & Representation::URLSEGMENTS))
+          {
+            // flags_ are read last, until here the urls belong to the process that saved the snapshot
+            for (STABLEVECTOR<Segment>::iterator bs(rep->segments_.data.begin()), es(rep->segments_.data.end()); bs != es; ++bs)
+              bs->url = nullptr;
+            rep->initialization_.url = nullptr;
+
+            for (STABLEVECTOR<Segment>::iterator bs(rep->segments_.data.begin()), es(rep->segments_.data.end()); ok && bs != es; ++bs)
+              ok = reader.ReadUrl(*bs);
+            if (ok && (rep->flags_ & Representation::INITIALIZATION))
+              ok = reader.ReadUrl(rep->initialization_);
+          }
+        }
+      }
+    }
+
+    if (!ok || periods_.empty())
+    {
+      Log(LOGLEVEL_ERROR, "Manifest snapshot of %s is invalid", manifest_url_.c_str());
+      remove(GetSnapshotFile(snapshot_path_, manifest_url_).c_str());
+      return false;
+    }
+
+    for (std::vector<Period*>::const_iterator bp(periods_.begin()), ep(periods_.end()); bp != ep; ++bp)
+      for (std::vector<AdaptationSet*>::const_iterator ba((*bp)->adaptationSets_.begin()), ea((*bp)->adaptationSets_.end()); ba != ea; ++ba)
+        for (std::vector<Representation*>::iterator br((*ba)->repesentations_.begin()), er((*ba)->repesentations_.end()); br != er; ++br)
+          (*br)->SetScaling();
+
+    current_period_ = periods_[0];
+    // Only static manifests are snapshotted
+    is_static_ = true;
+    Log(LOGLEVEL_DEBUG, "Manifest %s loaded from snapshot (%u bytes)", manifest_url_.c_str(), static_cast<unsigned int>(snapshot.size()));
+    return true;
+  }
+
+  void AdaptiveTree::SaveSnapshot()
+  {
+    if (snapshot_path_.empty() || !is_static_ || periods_.empty())
+      return;
+
+    MANIFESTVALIDATOR validator;
+    {
+      std::lock_guard<std::mutex> lck(m_mutex);
+      std::map<std::string, MANIFESTVALIDATOR>::const_iterator res(refresh_state_.validators_.find(manifest_url_));
+      // Without validators we could never tell if the snapshot is still valid
+      if (res == refresh_state_.validators_.end())
+        return;
+      validator = res->second;
+    }
+
+    std::string buf;
+    WriteSnapshot(buf, static_cast<uint32_t>(sizeof(Segment)));
+    WriteSnapshot(buf, manifest_url_);
+    WriteSnapshot(buf, supportedKeySystem_);
+    WriteSnapshot(buf, validator.etag_);
+    WriteSnapshot(buf, validator.lastModified_);
+    WriteSnapshot(buf, validator.size_);
+
+    WriteSnapshot(buf, overallSeconds_);
+    WriteSnapshot(buf, stream_start_);
+    WriteSnapshot(buf, available_time_);
+    WriteSnapshot(buf, publish_time_);
+    WriteSnapshot(buf, base_time_);
+    WriteSnapshot(buf, minPresentationOffset);
+    WriteSnapshot(buf, encryptionState_);
+    WriteSnapshot(buf, included_types_);
+    WriteSnapshot(buf, need_secure_decoder_);
+    WriteSnapshot(buf, license_url_);
+
+    WriteSnapshot(buf, static_cast<uint32_t>(psshSets_.size()));
+    for (std::vector<PSSH>::const_iterator b(psshSets_.begin()), e(psshSets_.end()); b != e; ++b)
+    {
+      WriteSnapshot(buf, b->pssh_);
+      WriteSnapshot(buf, b->defaultKID_);
+      WriteSnapshot(buf, b->iv);
+      WriteSnapshot(buf, b->media_);
+      WriteSnapshot(buf, b->use_count_);
+    }
+
+    WriteSnapshot(buf, static_cast<uint32_t>(periods_.size()));
+    for (std::vector<Period*>::const_iterator bp(periods_.begin()), ep(periods_.end()); bp != ep; ++bp)
+    {
+      const Period *period(*bp);
+      WriteSnapshot(buf, period->base_url_);
+      WriteSnapshot(buf, period->duration_);
+      WriteSnapshot(buf, period->timescale_);
+      WriteSnapshot(buf, period->startPTS_);
+      WriteSnapshot(buf, period->start_);
+      WriteSnapshot(buf, period->length_);
+      WriteSnapshot(buf, period->startNumber_);
+      WriteSnapshot(buf, period->segment_durations_.data);
+      WriteSnapshot(buf, period->segtpl_);
+
+      WriteSnapshot(buf, static_cast<uint32_t>(period->adaptationSets_.size()));
+      for (std::vector<AdaptationSet*>::const_iterator ba(period->adaptationSets_.begin()), ea(period->adaptationSets_.end()); ba != ea; ++ba)
+      {
+        const AdaptationSet *adp(*ba);
+        WriteSnapshot(buf, adp->type_);
+        WriteSnapshot(buf, adp->timescale_);
+        WriteSnapshot(buf, adp->duration_);
+        WriteSnapshot(buf, adp->startPTS_);
+        WriteSnapshot(buf, adp->startNumber_);
+        WriteSnapshot(buf, adp->impaired_);
+        WriteSnapshot(buf, adp->language_);
+        WriteSnapshot(buf, adp->mimeType_);
+        WriteSnapshot(buf, adp->base_url_);
+        WriteSnapshot(buf, adp->id);
+        WriteSnapshot(buf, adp->codecs_);
+        WriteSnapshot(buf, adp->segment_durations_.data);
+        WriteSnapshot(buf, adp->segtpl_);
+
+        WriteSnapshot(buf, static_cast<uint32_t>(adp->repesentations_.size()));
+        for (std::vector<Representation*>::const_iterator br(adp->repesentations_.begin()), er(adp->repesentations_.end()); br != er; ++br)
+        {
+          const Representation *rep(*br);
+          WriteSnapshot(buf, rep->url_);
+          WriteSnapshot(buf, rep->id);
+          WriteSnapshot(buf, rep->codecs_);
+          WriteSnapshot(buf, rep->codec_private_data_);
+          WriteSnapshot(buf, rep->source_url_);
+          WriteSnapshot(buf, rep->bandwidth_);
+          WriteSnapshot(buf, rep->samplingRate_);
+          WriteSnapshot(buf, rep->width_);
+          WriteSnapshot(buf, rep->height_);
+          WriteSnapshot(buf, rep->fpsRate_);
+          WriteSnapshot(buf, rep->fpsScale_);
+          WriteSnapshot(buf, rep->aspect_);
+          WriteSnapshot(buf, rep->hdcpVersion_);
+          WriteSnapshot(buf, rep->indexRangeMin_);
+          WriteSnapshot(buf, rep->indexRangeMax_);
+          WriteSnapshot(buf, rep->channelCount_);
+          WriteSnapshot(buf, rep->nalLengthSize_);
+          WriteSnapshot(buf, rep->pssh_set_);
+          WriteSnapshot(buf, rep->expired_segments_);
+          WriteSnapshot(buf, rep->containerType_);
+          WriteSnapshot(buf, rep->segtpl_);
+          WriteSnapshot(buf, rep->startNumber_);
+          WriteSnapshot(buf, rep->nextPts_);
+          WriteSnapshot(buf, rep->duration_);
+          WriteSnapshot(buf, rep->timescale_);
+          WriteSnapshot(buf, rep->initialization_);
+          WriteSnapshot(buf, rep->segments_.data);
+          // Sub indexes of hierarchical SIDX not loaded yet, byte ranges only
+          WriteSnapshot(buf, rep->subIndexes_);
+          WriteSnapshot(buf, static_cast<uint16_t>(rep->flags_ & ~Representation::ENABLED));
+
+          if (rep->flags_ & Representation::URLSEGMENTS)
+          {
+            for (STABLEVECTOR<Segment>::const_iterator bs(rep->segments_.data.begin()), es(rep->segments_.data.end()); bs != es; ++bs)
+              WriteSnapshot(buf, std::string(bs->url ? bs->url : ""));
+            if (rep->flags_ & Representation::INITIALIZATION)
+              WriteSnapshot(buf, std::string(rep->initialization_.url ? rep->initialization_.url : ""));
+          }
+        }
+      }
+    }
+
+    std::string header;
+    WriteSnapshot(header, SNAPSHOT_MAGIC);
+    WriteSnapshot(header, SNAPSHOT_VERSION);
+    WriteSnapshot(header, GetSnapshotChecksum(buf.data(), buf.size()));
+
+    std::string fn(GetSnapshotFile(snapshot_path_, manifest_url_));
+    FILE *f(fopen(fn.c_str(), "wb"));
+    if (!f)
+      return;
+    bool written(fwrite(header.data(), 1, header.size(), f) == header.size() && fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+    fclose(f);
+    if (!written)
+      remove(fn.c_str());
+  }
+
 } // namespace
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <string>
 #include <map>
 #include <inttypes.h>
@@ -27,6 +29,179 @@
 
 namespace adaptive
 {
+  /* Growable array which never relocates its elements: entries are stored
+     in blocks of fixed capacity and a new block is started when the last one
+     is full. Pointers to elements stay valid until release_front() frees
+     the block holding them. Positions of elements are found by the address
+     range (granule) they lie in, each granule maps to the few blocks touching it. */
+  template <typename T>
+  class STABLEVECTOR
+  {
+  public:
+    static const size_t BLOCKSIZE = 256;
+
+    template <typename C, typename V>
+    class ITERATOR
+    {
+    public:
+      ITERATOR(C *owner, size_t pos) :owner_(owner), pos_(pos) {};
+
+      V &operator*() const { return (*owner_)[pos_]; };
+      V *operator->() const { return &(*owner_)[pos_]; };
+      ITERATOR &operator++() { ++pos_; return *this; };
+      ITERATOR operator++(int) { ITERATOR tmp(*this); ++pos_; return tmp; };
+      bool operator==(const ITERATOR &other) const { return pos_ == other.pos_; };
+      bool operator!=(const ITERATOR &other) const { return pos_ != other.pos_; };
+      operator ITERATOR<const C, const V>() const { return ITERATOR<const C, const V>(owner_, pos_); };
+
+    private:
+      C *owner_;
+      size_t pos_;
+    };
+
+    typedef ITERATOR<STABLEVECTOR, T> iterator;
+    typedef ITERATOR<const STABLEVECTOR, const T> const_iterator;
+
+    STABLEVECTOR() :size_(0), firstBlock_(0) {};
+    STABLEVECTOR(const STABLEVECTOR &other) :size_(0), firstBlock_(0) { *this = other; };
+
+    STABLEVECTOR &operator=(const STABLEVECTOR &other)
+    {
+      // Copy element wise, copied blocks would not have their full capacity
+      if (this != &other)
+      {
+        clear();
+        for (const_iterator b(other.begin()), e(other.end()); b != e; ++b)
+          push_back(*b);
+      }
+      return *this;
+    }
+
+    T &operator[](size_t pos) { return blocks_[pos / BLOCKSIZE][pos % BLOCKSIZE]; };
+    const T &operator[](size_t pos) const { return blocks_[pos / BLOCKSIZE][pos % BLOCKSIZE]; };
+
+    iterator begin() { return iterator(this, 0); };
+    iterator end() { return iterator(this, size_); };
+    const_iterator begin() const { return const_iterator(this, 0); };
+    const_iterator end() const { return const_iterator(this, size_); };
+
+    T &back() { return blocks_.back().back(); };
+    const T &back() const { return blocks_.back().back(); };
+
+    void push_back(const T &elem)
+    {
+      if (blocks_.empty() || blocks_.back().size() == BLOCKSIZE)
+      {
+        blocks_.push_back(std::vector<T>());
+        blocks_.back().reserve(BLOCKSIZE);
+        MapBlock(firstBlock_ + blocks_.size() - 1, true);
+      }
+      blocks_.back().push_back(elem);
+      ++size_;
+    }
+
+    void resize(size_t count)
+    {
+      for (; size_ > count; --size_)
+      {
+        blocks_.back().pop_back();
+        if (blocks_.back().empty())
+        {
+          MapBlock(firstBlock_ + blocks_.size() - 1, false);
+          blocks_.pop_back();
+        }
+      }
+      while (size_ < count)
+        push_back(T());
+    }
+
+    // Blocks are allocated on demand
+    void reserve(size_t) {};
+
+    void clear()
+    {
+      blocks_.clear();
+      granules_.clear();
+      size_ = 0;
+      firstBlock_ = 0;
+    }
+
+    void swap(STABLEVECTOR &other)
+    {
+      blocks_.swap(other.blocks_);
+      granules_.swap(other.granules_);
+      std::swap(size_, other.size_);
+      std::swap(firstBlock_, other.firstBlock_);
+    }
+
+    bool empty() const { return !size_; };
+
+    size_t size() const { return size_; };
+
+    // Position of elem, ~0 if it is not stored here (anymore)
+    size_t index(const T *elem) const
+    {
+      uintptr_t addr(reinterpret_cast<uintptr_t>(elem));
+      typedef typename GRANULEMAP::const_iterator GRANULEITER;
+      std::pair<GRANULEITER, GRANULEITER> range(granules_.equal_range(addr / GRANULE));
+      for (; range.first != range.second; ++range.first)
+      {
+        size_t block(range.first->second - firstBlock_);
+        uintptr_t first(reinterpret_cast<uintptr_t>(blocks_[block].data()));
+        if (addr >= first && addr < first + blocks_[block].size() * sizeof(T))
+          return block * BLOCKSIZE + (addr - first) / sizeof(T);
+      }
+      return ~static_cast<size_t>(0);
+    }
+
+    // Frees the full blocks in front of position count, returns the number of entries removed
+    size_t release_front(size_t count)
+    {
+      size_t blocks(count / BLOCKSIZE);
+      for (size_t i(0); i < blocks; ++i)
+        MapBlock(firstBlock_ + i, false);
+      blocks_.erase(blocks_.begin(), blocks_.begin() + blocks);
+      firstBlock_ += blocks;
+      size_ -= blocks * BLOCKSIZE;
+      return blocks * BLOCKSIZE;
+    }
+
+  private:
+    // Address range size of a full block, a block touches at most a few granules
+    static const uintptr_t GRANULE = BLOCKSIZE * sizeof(T);
+    typedef std::unordered_multimap<uintptr_t, size_t> GRANULEMAP;
+
+    void MapBlock(size_t number, bool add)
+    {
+      const std::vector<T> &block(blocks_[number - firstBlock_]);
+      uintptr_t first(reinterpret_cast<uintptr_t>(block.data()));
+      uintptr_t last((first + block.capacity() * sizeof(T) - 1) / GRANULE);
+      for (first /= GRANULE; first <= last; ++first)
+        if (add)
+          granules_.insert(std::make_pair(first, number));
+        else
+        {
+          std::pair<typename GRANULEMAP::iterator, typename GRANULEMAP::iterator> range(granules_.equal_range(first));
+          for (; range.first != range.second; ++range.first)
+            if (range.first->second == number)
+            {
+              granules_.erase(range.first);
+              break;
+            }
+        }
+    }
+
+    std::deque<std::vector<T> > blocks_;
+    // Granule -> absolute block number, blocks_[0] has number firstBlock_
+    GRANULEMAP granules_;
+    size_t size_, firstBlock_;
+  };
+
+  /* Sliding window over data: live entries are data[basePos..size()).
+     Trimming only advances basePos and appending never relocates entries,
+     so pointers to segments stay valid while the live index grows.
+     Storage of trimmed entries is released once they are more than a
+     window behind, a stream lagging that far has to re-resolve by time. */
   template <typename T>
   struct SPINCACHE
   {
@@ -36,34 +211,31 @@ namespace adaptive
 
     const T *operator[](uint32_t pos) const
     {
-      if (!~pos)
+      if (!~pos || basePos + pos >= data.size())
         return 0;
-      size_t realPos = basePos + pos;
-      if (realPos >= data.size())
-      {
-        realPos -= data.size();
-        if (realPos == basePos)
-          return 0;
-      }
-      return &data[realPos];
+      return &data[basePos + pos];
     };
 
+    // Entries just trimmed in front return negative positions (wrapped), so pos + 1 is still their successor
     uint32_t pos(const T* elem) const
     {
-      size_t realPos = elem - &data[0];
-      if (realPos < basePos)
-        realPos += data.size() - basePos;
-      else
-        realPos -= basePos;
-      return static_cast<std::uint32_t>(realPos);
+      size_t index(data.index(elem));
+      return ~index ? static_cast<std::uint32_t>(index - basePos) : ~0U;
     };
 
-    void insert(const T &elem)
+    void append(const T &elem)
+    {
+      data.push_back(elem);
+      size_t window(size());
+      if (basePos > window)
+        basePos -= data.release_front(basePos - window);
+    }
+
+    void trim(size_t count)
     {
-      data[basePos] = elem;
-      ++basePos;
-      if (basePos == data.size())
-        basePos = 0;
+      basePos += count;
+      if (basePos > data.size())
+        basePos = data.size();
     }
 
     void swap(SPINCACHE<T> &other)
@@ -78,11 +250,11 @@ namespace adaptive
       basePos = 0;
     }
 
-    bool empty() const { return data.empty(); };
+    bool empty() const { return basePos == data.size(); };
 
-    size_t size() const { return data.size(); };
+    size_t size() const { return data.size() - basePos; };
 
-    std::vector<T> data;
+    STABLEVECTOR<T> data;
   };
 
   class AdaptiveTree
@@ -121,10 +293,13 @@ namespace adaptive
 
     struct SegmentTemplate
     {
-      SegmentTemplate() : timescale(0), duration(0) {};
+      SegmentTemplate() : timescale(0), duration(0), presentationTimeOffset(0), availabilityTimeOffset(0.0), availabilityTimeComplete(true) {};
       std::string initialization;
       std::string media;
       unsigned int timescale, duration;
+      uint64_t presentationTimeOffset;
+      double availabilityTimeOffset; //seconds a segment can be requested before its end
+      bool availabilityTimeComplete; //false if segments are delivered chunked while being produced
     };
 
     struct Representation
@@ -155,6 +330,7 @@ namespace adaptive
       static const uint16_t ENABLED = 256;
       static const uint16_t HASUPDATESEGMENTS = 512;
       static const uint16_t INITIALIZATION_PREFIXED = 1024;
+      static const uint16_t CHUNKEDSEGMENTS = 2048;
 
 
       uint16_t flags_;
@@ -173,12 +349,14 @@ namespace adaptive
       uint32_t timescale_ext_, timescale_int_;
       Segment initialization_;
       SPINCACHE<Segment> segments_, newSegments_;
+      // Hierarchical SIDX: not yet loaded sub indexes, ranges cover the sidx and its media
+      std::vector<Segment> subIndexes_;
       const Segment *get_initialization()const { return (flags_ & INITIALIZATION) ? &initialization_ : 0; };
       const Segment *get_next_segment(const Segment *seg)const
       {
         if (!seg || seg == &initialization_)
           return segments_[0];
-        else if (segments_.pos(seg) + 1 == segments_.data.size())
+        else if (segments_.pos(seg) + 1 == segments_.size())
           return nullptr;
         else
           return segments_[segments_.pos(seg) + 1];
@@ -191,7 +369,7 @@ namespace adaptive
 
       const uint32_t get_segment_pos(const Segment *segment)const
       {
-        return segment ? segments_.data.empty() ? 0 : segments_.pos(segment) : ~0;
+        return segment ? segments_.empty() ? 0 : segments_.pos(segment) : ~0;
       }
 
       const uint16_t get_psshset() const
@@ -255,12 +433,14 @@ namespace adaptive
 
     struct Period
     {
-      Period(): timescale_(0), duration_(0), startPTS_(0), startNumber_(1) {};
+      Period(): timescale_(0), duration_(0), startPTS_(0), start_(0), length_(0), startNumber_(1) {};
       ~Period() { for (std::vector<AdaptationSet* >::const_iterator b(adaptationSets_.begin()), e(adaptationSets_.end()); b != e; ++b) delete *b; };
       std::vector<AdaptationSet*> adaptationSets_;
       std::string base_url_;
       uint32_t duration_, timescale_;
       uint64_t startPTS_;
+      uint64_t start_; //ms after availabilityStartTime
+      uint64_t length_; //ms, 0 if unknown
       unsigned int startNumber_;
       SPINCACHE<uint32_t> segment_durations_;
       SegmentTemplate segtpl_;
@@ -277,9 +457,14 @@ namespace adaptive
     uint64_t overallSeconds_, stream_start_, available_time_, publish_time_, base_time_;
     uint64_t minPresentationOffset;
     bool has_timeshift_buffer_;
+    bool is_static_; //manifest declares itself static (MPD@type, Smooth without IsLive), only those are snapshotted
 
     uint32_t bandwidth_;
+    uint32_t live_delay_; //seconds behind the live edge, 0 for default
+    uint32_t timeshift_buffer_depth_; //seconds of live segments we keep, 0 if unknown
+    int64_t clock_offset_; //ms the origin clock is ahead of ours
     std::map<std::string, std::string> manifest_headers_;
+    std::string snapshot_path_; //directory to keep snapshots of parsed static manifests, empty if disabled
 
     double download_speed_, average_download_speed_;
 
@@ -320,6 +505,21 @@ namespace adaptive
 
     std::string strXMLText_;
 
+    // Validators of refreshed manifests, used to send conditional requests
+    struct MANIFESTVALIDATOR
+    {
+      MANIFESTVALIDATOR() :size_(0) {};
+      std::string etag_, lastModified_;
+      size_t size_;
+    };
+    struct REFRESHSTATE
+    {
+      REFRESHSTATE() :modified_(0), notModified_(0), bytesSaved_(0) {};
+      std::map<std::string, MANIFESTVALIDATOR> validators_;
+      uint32_t modified_, notModified_;
+      uint64_t bytesSaved_;
+    }refresh_state_;
+
     AdaptiveTree();
     virtual ~AdaptiveTree();
 
@@ -327,6 +527,18 @@ namespace adaptive
     virtual bool prepareRepresentation(Representation *rep, bool update = false) { return true; };
     virtual void OnDataArrived(Representation *rep, const Segment *seg, const uint8_t *src, uint8_t *dst, size_t dstOffset, size_t dataSize);
     virtual void RefreshSegments(Representation *rep, const Segment *seg) {};
+    // Local wall clock time in ms when seg gets available on the origin, 0 if it can be requested right away
+    virtual uint64_t GetSegmentAvailableTime(const Representation *rep, const Segment *seg) const { return 0; };
+    // Live segments still in production can be fetched part by part, returns false if there are no (more) parts
+    virtual bool GetSegmentPart(const Representation *rep, const Segment *seg, unsigned int part, std::string &url) { return false; };
+    // Streams flag the representation they play, trees with background workers serialize this with them
+    virtual void SetRepresentationEnabled(Representation *rep, bool enabled)
+    {
+      if (enabled)
+        rep->flags_ |= Representation::ENABLED;
+      else
+        rep->flags_ &= ~Representation::ENABLED;
+    };
 
     uint16_t insert_psshset(StreamType type);
     bool has_type(StreamType t);
@@ -334,17 +546,33 @@ namespace adaptive
     double get_download_speed() const { return download_speed_; };
     double get_average_download_speed() const { return average_download_speed_; };
     void set_download_speed(double speed);
-    void SetFragmentDuration(const AdaptationSet* adp, const Representation* rep, size_t pos, uint64_t timestamp, uint32_t fragmentDuration, uint32_t movie_timescale);
+    // Streams demuxed in threads of their own call this concurrently, the segment is located under the tree's lock
+    void SetFragmentDuration(const AdaptationSet* adp, const Representation* rep, const Segment* segment, uint64_t timestamp, uint32_t fragmentDuration, uint32_t movie_timescale);
+
+    // Init segments by url and byte range (see AdaptiveStream::getInitKey), shared by all streams
+    bool GetInitSegment(const std::string &key, std::string &data);
+    void AddInitSegment(const std::string &key, const std::string &data);
 
     bool empty(){ return !current_period_ || current_period_->adaptationSets_.empty(); };
     const AdaptationSet *GetAdaptationSet(unsigned int pos) const { return current_period_ && pos < current_period_->adaptationSets_.size() ? current_period_->adaptationSets_[pos] : 0; };
 protected:
-  virtual bool download(const char* url, const std::map<std::string, std::string> &manifestHeaders);
-  virtual bool write_data(void *buffer, size_t buffer_size) = 0;
+  // With notModified set, a conditional request is sent and a 304 response sets *notModified instead of delivering data
+  virtual bool download(const char* url, const std::map<std::string, std::string> &manifestHeaders, void *opaque = nullptr, bool *notModified = nullptr);
+  void UpdateValidator(const char* url, const MANIFESTVALIDATOR &validator);
+  virtual bool write_data(void *buffer, size_t buffer_size, void *opaque) = 0;
   bool PreparePaths(const std::string &url, const std::string &manifestUpdateParam);
   void SortTree();
+  size_t GetExpiredSegments(const Representation *rep, size_t maxCount, size_t appendCount) const;
+  void TrimSegments(Representation *rep, size_t count);
+  // A snapshot is only used if the origin confirms (304) the validators stored with it
+  bool ReadSnapshot(std::string &snapshot);
+  bool LoadSnapshot(const std::string &snapshot);
+  void SaveSnapshot();
+  // Serializes the writers of the live segment index
+  std::mutex m_segmentMutex;
 private:
   std::mutex m_mutex;
+  std::map<std::string, std::string> init_segments_;
 };
 
 }
@@ -22,6 +22,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
 
 #include "libXBMC_addon.h"
 #include "kodi_vfs_types.h"
@@ -183,6 +189,15 @@ public:
     bytesRead = stream_->read(buffer, bytesToRead);
     return bytesRead > 0 ? AP4_SUCCESS : AP4_ERROR_READ_FAILED;
   };
+  // Hands out what has been downloaded already, at least one byte. Reads may
+  // run into the next segment, fine for TS but not for MP4 atoms (ReadPartial)
+  AP4_Result ReadAvailable(void* buffer,
+    AP4_Size  bytesToRead,
+    AP4_Size& bytesRead)
+  {
+    bytesRead = stream_->read(buffer, bytesToRead, 1);
+    return bytesRead > 0 ? AP4_SUCCESS : AP4_ERROR_READ_FAILED;
+  };
   AP4_Result WritePartial(const void* buffer,
     AP4_Size    bytesToWrite,
     AP4_Size&   bytesWritten) override
@@ -216,7 +231,7 @@ protected:
 Kodi Streams implementation
 ********************************************************/
 
-bool adaptive::AdaptiveTree::download(const char* url, const std::map<std::string, std::string> &manifestHeaders)
+bool adaptive::AdaptiveTree::download(const char* url, const std::map<std::string, std::string> &manifestHeaders, void *opaque, bool *notModified)
 {
   // open the file
   void* file = xbmc->CURLCreate(url);
@@ -230,17 +245,69 @@ bool adaptive::AdaptiveTree::download(const char* url, const std::map<std::strin
     xbmc->CURLAddOption(file, XFILE::CURL_OPTION_HEADER, entry.first.c_str(), entry.second.c_str());
   }
 
+  size_t knownSize(0);
+  if (notModified)
+  {
+    *notModified = false;
+    std::lock_guard<std::mutex> lck(m_mutex);
+    std::map<std::string, MANIFESTVALIDATOR>::const_iterator validator(refresh_state_.validators_.find(url));
+    if (validator != refresh_state_.validators_.end())
+    {
+      if (!validator->second.etag_.empty())
+        xbmc->CURLAddOption(file, XFILE::CURL_OPTION_HEADER, "If-None-Match", validator->second.etag_.c_str());
+      if (!validator->second.lastModified_.empty())
+        xbmc->CURLAddOption(file, XFILE::CURL_OPTION_HEADER, "If-Modified-Since", validator->second.lastModified_.c_str());
+      knownSize = validator->second.size_;
+    }
+  }
+
   xbmc->CURLOpen(file, XFILE::READ_CHUNKED | XFILE::READ_NO_CACHE);
 
+  MANIFESTVALIDATOR validator;
+  if (notModified)
+  {
+    // Status line, e.g. "HTTP/1.1 304 Not Modified"
+    char *value(xbmc->GetFilePropertyValue(file, XFILE::FILE_PROPERTY_RESPONSE_PROTOCOL, ""));
+    if (value)
+    {
+      const char *status(strchr(value, ' '));
+      *notModified = status && atoi(status + 1) == 304;
+      xbmc->FreeString(value);
+    }
+    if (*notModified)
+    {
+      xbmc->CloseFile(file);
+      xbmc->Log(ADDON::LOG_DEBUG, "Download %s not modified", url);
+      std::lock_guard<std::mutex> lck(m_mutex);
+      ++refresh_state_.notModified_;
+      refresh_state_.bytesSaved_ += knownSize;
+      return true;
+    }
+    if ((value = xbmc->GetFilePropertyValue(file, XFILE::FILE_PROPERTY_RESPONSE_HEADER, "etag")))
+    {
+      validator.etag_ = value;
+      xbmc->FreeString(value);
+    }
+    if ((value = xbmc->GetFilePropertyValue(file, XFILE::FILE_PROPERTY_RESPONSE_HEADER, "last-modified")))
+    {
+      validator.lastModified_ = value;
+      xbmc->FreeString(value);
+    }
+  }
+
   // read the file
   static const unsigned int CHUNKSIZE = 16384;
   char buf[CHUNKSIZE];
   size_t nbRead;
-  while ((nbRead = xbmc->ReadFile(file, buf, CHUNKSIZE)) > 0 && ~nbRead && write_data(buf, nbRead));
+  while ((nbRead = xbmc->ReadFile(file, buf, CHUNKSIZE)) > 0 && ~nbRead && write_data(buf, nbRead, opaque))
+    validator.size_ += nbRead;
   xbmc->CloseFile(file);
 
   xbmc->Log(ADDON::LOG_DEBUG, "Download %s finished", url);
 
+  if (notModified && nbRead == 0)
+    UpdateValidator(url, validator);
+
   return nbRead == 0;
 }
 
@@ -262,9 +329,31 @@ bool KodiAdaptiveStream::download(const char* url, const std::map<std::string, s
   xbmc->CURLOpen(file, XFILE::READ_CHUNKED | XFILE::READ_NO_CACHE);
 
   // read the file
-  char *buf = (char*)malloc(32*1024);
+  static const size_t CHUNKSIZE = 32 * 1024;
+  char *buf = (char*)malloc(CHUNKSIZE);
   size_t nbRead, nbReadOverall = 0;
-  while ((nbRead = xbmc->ReadFile(file, buf, 32 * 1024)) > 0 && ~nbRead && write_data(buf, nbRead)) nbReadOverall+= nbRead;
+
+  // Chunked live segments arrive in bursts while being produced. Only reads following a
+  // completely filled buffer did not wait for the encoder, so only these measure throughput.
+  bool chunked((getRepresentation()->flags_ & adaptive::AdaptiveTree::Representation::CHUNKEDSEGMENTS) != 0), drained(true);
+  std::chrono::steady_clock::duration activeTime(0);
+  size_t activeBytes(0);
+
+  while (true)
+  {
+    std::chrono::steady_clock::time_point readStart(std::chrono::steady_clock::now());
+    if ((nbRead = xbmc->ReadFile(file, buf, CHUNKSIZE)) == 0 || !~nbRead)
+      break;
+    if (!drained)
+    {
+      activeTime += std::chrono::steady_clock::now() - readStart;
+      activeBytes += nbRead;
+    }
+    drained = nbRead < CHUNKSIZE;
+    if (!write_data(buf, nbRead))
+      break;
+    nbReadOverall += nbRead;
+  }
   free(buf);
 
   if (!nbReadOverall)
@@ -273,7 +362,11 @@ bool KodiAdaptiveStream::download(const char* url, const std::map<std::string, s
     return false;
   }
 
-  double current_download_speed_ = xbmc->GetFileDownloadSpeed(file);
+  double current_download_speed_;
+  if (chunked && activeTime >= std::chrono::milliseconds(10))
+    current_download_speed_ = activeBytes / std::chrono::duration<double>(activeTime).count();
+  else
+    current_download_speed_ = xbmc->GetFileDownloadSpeed(file);
   //Calculate the new downloadspeed to 1MB
   static const size_t ref_packet = 1024 * 1024;
   if (nbReadOverall >= ref_packet)
@@ -291,115 +384,246 @@ bool KodiAdaptiveStream::download(const char* url, const std::map<std::string, s
   return nbRead == 0;
 }
 
-bool KodiAdaptiveStream::parseIndexRange()
-{
-  // open the file
-  xbmc->Log(ADDON::LOG_DEBUG, "Downloading %s for SIDX generation", getRepresentation()->url_.c_str());
-
-  // open the file
-  void* file = xbmc->CURLCreate(getRepresentation()->url_.c_str());
-  if (!file)
-    return false;
-  xbmc->CURLAddOption(file, XFILE::CURL_OPTION_PROTOCOL, "seekable", "0");
+/*******************************************************
+|   IndexRangeReader: fetches byte ranges of a segment
+|   base file on demand. Box headers are probed with a
+|   small request before their payload is downloaded.
+********************************************************/
 
-  char rangebuf[64];
-  sprintf(rangebuf, "bytes=%u-%u", getRepresentation()->indexRangeMin_, getRepresentation()->indexRangeMax_);
-  xbmc->CURLAddOption(file, XFILE::CURL_OPTION_HEADER, "Range", rangebuf);
+static const uint32_t INDEX_PROBE_SIZE = 16 * 1024;
 
+class IndexRangeReader
+{
+public:
+  IndexRangeReader(const std::string &url) : m_url(url), m_begin(0), m_requests(0) {};
 
-  if (!xbmc->CURLOpen(file, XFILE::READ_CHUNKED | XFILE::READ_NO_CACHE | XFILE::READ_AUDIO_VIDEO))
+  // Provides the bytes [offset, offset + size), downloads them if not already present
+  bool Get(uint64_t offset, uint64_t size, const AP4_UI08 *&data)
   {
-    xbmc->Log(ADDON::LOG_ERROR, "Download SIDX retrieval failed");
-    return false;
+    if (offset < m_begin || offset + size > m_begin + m_data.GetDataSize())
+    {
+      if (!Download(offset, offset + (size > INDEX_PROBE_SIZE ? size : INDEX_PROBE_SIZE) - 1)
+        || m_data.GetDataSize() < size)
+        return false;
+    }
+    data = m_data.GetData() + (offset - m_begin);
+    return true;
   }
 
-  // read the file into AP4_MemoryByteStream
-  AP4_MemoryByteStream byteStream;
-
-  char buf[16384];
-  size_t nbRead, nbReadOverall = 0;
-  while((nbRead = xbmc->ReadFile(file, buf, 16384)) > 0 && ~nbRead && AP4_SUCCEEDED(byteStream.Write(buf, nbRead))) nbReadOverall += nbRead;
-  xbmc->CloseFile(file);
-
-  if (nbReadOverall != getRepresentation()->indexRangeMax_ - getRepresentation()->indexRangeMin_ +1)
+  bool GetBoxHeader(uint64_t offset, uint64_t &size, AP4_UI32 &type)
   {
-    xbmc->Log(ADDON::LOG_ERROR, "Size of downloaded SIDX section differs from expected");
-    return false;
+    const AP4_UI08 *data;
+    if (!Get(offset, 8, data))
+      return false;
+    size = AP4_BytesToUInt32BE(data);
+    type = AP4_BytesToUInt32BE(data + 4);
+    if (size == 1)
+    {
+      if (!Get(offset, 16, data))
+        return false;
+      size = AP4_BytesToUInt64BE(data + 8);
+    }
+    return size >= 8;
   }
-  byteStream.Seek(0);
 
-  adaptive::AdaptiveTree::Representation *rep(const_cast<adaptive::AdaptiveTree::Representation*>(getRepresentation()));
-  adaptive::AdaptiveTree::AdaptationSet *adp(const_cast<adaptive::AdaptiveTree::AdaptationSet*>(getAdaptationSet()));
+  unsigned int GetRequests() const { return m_requests; };
 
-  if (!getRepresentation()->indexRangeMin_)
+private:
+  bool Download(uint64_t begin, uint64_t end)
   {
-    AP4_File f(byteStream, AP4_DefaultAtomFactory::Instance, true);
-    AP4_Movie* movie = f.GetMovie();
-    if (movie == NULL)
-    {
-      xbmc->Log(ADDON::LOG_ERROR, "No MOOV in stream!");
+    m_data.SetDataSize(0);
+    m_begin = begin;
+    ++m_requests;
+
+    void* file = xbmc->CURLCreate(m_url.c_str());
+    if (!file)
       return false;
-    }
-    rep->flags_ |= adaptive::AdaptiveTree::Representation::INITIALIZATION;
-    rep->initialization_.range_begin_ = 0;
-    AP4_Position pos;
-    byteStream.Tell(pos);
-    rep->initialization_.range_end_ = pos - 1;
-  }
+    xbmc->CURLAddOption(file, XFILE::CURL_OPTION_PROTOCOL, "seekable", "0");
 
-  adaptive::AdaptiveTree::Segment seg;
-  seg.startPTS_ = 0;
-  unsigned int numSIDX(1);
+    char rangebuf[64];
+    sprintf(rangebuf, "bytes=%" PRIu64 "-%" PRIu64, begin, end);
+    xbmc->CURLAddOption(file, XFILE::CURL_OPTION_HEADER, "Range", rangebuf);
 
-  do
-  {
-    AP4_Atom *atom(NULL);
-    if (AP4_FAILED(AP4_DefaultAtomFactory::Instance.CreateAtomFromStream(byteStream, atom)))
+    if (!xbmc->CURLOpen(file, XFILE::READ_CHUNKED | XFILE::READ_NO_CACHE | XFILE::READ_AUDIO_VIDEO))
     {
-      xbmc->Log(ADDON::LOG_ERROR, "Unable to create SIDX from IndexRange bytes");
+      xbmc->CloseFile(file);
       return false;
     }
 
-    if (atom->GetType() == AP4_ATOM_TYPE_MOOF)
+    // A server ignoring the range delivers the file from its start
+    bool partial(true);
+    char *value(xbmc->GetFilePropertyValue(file, XFILE::FILE_PROPERTY_RESPONSE_PROTOCOL, ""));
+    if (value)
     {
-      delete atom;
-      break;
+      const char *status(strchr(value, ' '));
+      partial = !status || atoi(status + 1) != 200;
+      xbmc->FreeString(value);
     }
-    else if (atom->GetType() != AP4_ATOM_TYPE_SIDX)
+    if (!partial && begin)
     {
-      delete atom;
-      continue;
+      xbmc->CloseFile(file);
+      xbmc->Log(ADDON::LOG_ERROR, "Server ignores range requests for %s", m_url.c_str());
+      return false;
     }
 
-    AP4_SidxAtom *sidx(AP4_DYNAMIC_CAST(AP4_SidxAtom, atom));
-    const AP4_Array<AP4_SidxAtom::Reference> &refs(sidx->GetReferences());
-    if (refs[0].m_ReferenceType == 1)
+    // Stop reading once the range is complete, the file may be delivered as a whole
+    AP4_Size wanted(static_cast<AP4_Size>(end - begin + 1));
+    m_data.Reserve(wanted);
+    char buf[16384];
+    size_t nbRead;
+    while (m_data.GetDataSize() < wanted && (nbRead = xbmc->ReadFile(file, buf, 16384)) > 0 && ~nbRead)
     {
-      numSIDX = refs.ItemCount();
-      delete atom;
-      continue;
+      if (nbRead > wanted - m_data.GetDataSize())
+        nbRead = wanted - m_data.GetDataSize();
+      m_data.AppendData(reinterpret_cast<AP4_UI08*>(buf), static_cast<AP4_Size>(nbRead));
     }
-    AP4_Position pos;
-    byteStream.Tell(pos);
-    seg.range_end_ = pos + getRepresentation()->indexRangeMin_ + sidx->GetFirstOffset() - 1;
-    rep->timescale_ = sidx->GetTimeScale();
-    rep->SetScaling();
+    xbmc->CloseFile(file);
+    return m_data.GetDataSize() > 0;
+  }
+
+  std::string m_url;
+  uint64_t m_begin;
+  AP4_DataBuffer m_data;
+  unsigned int m_requests;
+};
 
-    for (unsigned int i(0); i < refs.ItemCount(); ++i)
+/* Adds the segments referenced by a sidx box located at [offset, offset + size).
+   References to further sidx boxes (hierarchical index) are queued in front
+   of the representation's pending sub indexes and loaded when playback reaches them */
+static bool AddSidxSegments(const AP4_UI08 *data, uint64_t offset, uint64_t size, uint64_t startPTS,
+  adaptive::AdaptiveTree::Representation *rep, adaptive::AdaptiveTree::AdaptationSet *adp)
+{
+  AP4_MemoryByteStream byteStream(data, static_cast<AP4_Size>(size));
+  AP4_Atom *atom(NULL);
+  if (AP4_FAILED(AP4_DefaultAtomFactory::Instance.CreateAtomFromStream(byteStream, atom)))
+  {
+    xbmc->Log(ADDON::LOG_ERROR, "Unable to create SIDX from IndexRange bytes");
+    return false;
+  }
+  AP4_SidxAtom *sidx(AP4_DYNAMIC_CAST(AP4_SidxAtom, atom));
+  if (!sidx)
+  {
+    delete atom;
+    xbmc->Log(ADDON::LOG_ERROR, "IndexRange does not point to a SIDX");
+    return false;
+  }
+
+  const AP4_Array<AP4_SidxAtom::Reference> &refs(sidx->GetReferences());
+  std::vector<adaptive::AdaptiveTree::Segment> subIndexes;
+
+  adaptive::AdaptiveTree::Segment seg;
+  seg.startPTS_ = startPTS;
+  seg.pssh_set_ = 0;
+  seg.range_end_ = offset + size + sidx->GetFirstOffset() - 1;
+  rep->timescale_ = sidx->GetTimeScale();
+  rep->SetScaling();
+
+  for (unsigned int i(0); i < refs.ItemCount(); ++i)
+  {
+    seg.range_begin_ = seg.range_end_ + 1;
+    seg.range_end_ = seg.range_begin_ + refs[i].m_ReferencedSize - 1;
+    if (refs[i].m_ReferenceType == 1)
+      subIndexes.push_back(seg);
+    else
     {
-      seg.range_begin_ = seg.range_end_ + 1;
-      seg.range_end_ = seg.range_begin_ + refs[i].m_ReferencedSize - 1;
-      rep->segments_.data.push_back(seg);
-      if (adp->segment_durations_.data.size() < rep->segments_.data.size())
-        adp->segment_durations_.data.push_back(refs[i].m_SubsegmentDuration);
-      seg.startPTS_ += refs[i].m_SubsegmentDuration;
+      rep->segments_.append(seg);
+      if (adp->segment_durations_.size() < rep->segments_.size())
+        adp->segment_durations_.append(refs[i].m_SubsegmentDuration);
     }
-    delete atom;
-    --numSIDX;
-  } while (numSIDX);
+    seg.startPTS_ += refs[i].m_SubsegmentDuration;
+  }
+  rep->subIndexes_.insert(rep->subIndexes_.begin(), subIndexes.begin(), subIndexes.end());
+  delete atom;
   return true;
 }
 
+bool KodiAdaptiveStream::parseIndexRange()
+{
+  adaptive::AdaptiveTree::Representation *rep(const_cast<adaptive::AdaptiveTree::Representation*>(getRepresentation()));
+  adaptive::AdaptiveTree::AdaptationSet *adp(const_cast<adaptive::AdaptiveTree::AdaptationSet*>(getAdaptationSet()));
+
+  xbmc->Log(ADDON::LOG_DEBUG, "Downloading %s for SIDX generation", rep->url_.c_str());
+
+  IndexRangeReader reader(rep->url_);
+  uint64_t sidxBegin(rep->indexRangeMin_), sidxSize(rep->indexRangeMax_ - rep->indexRangeMin_ + 1);
+
+  if (!rep->indexRangeMin_)
+  {
+    // Index position unknown: walk the top level boxes to find moov and sidx
+    uint64_t offset(0), size;
+    AP4_UI32 type;
+    bool hasMoov(false);
+    while (true)
+    {
+      if (!reader.GetBoxHeader(offset, size, type) || type == AP4_ATOM_TYPE_MOOF || type == AP4_ATOM_TYPE_MDAT)
+      {
+        xbmc->Log(ADDON::LOG_ERROR, "No SIDX in stream!");
+        return false;
+      }
+      if (type == AP4_ATOM_TYPE_SIDX)
+        break;
+      if (type == AP4_ATOM_TYPE_MOOV)
+      {
+        hasMoov = true;
+        rep->flags_ |= adaptive::AdaptiveTree::Representation::INITIALIZATION;
+        rep->initialization_.range_begin_ = 0;
+        rep->initialization_.range_end_ = offset + size - 1;
+      }
+      offset += size;
+    }
+    if (!hasMoov)
+    {
+      xbmc->Log(ADDON::LOG_ERROR, "No MOOV in stream!");
+      return false;
+    }
+    sidxBegin = offset;
+    sidxSize = size;
+  }
+
+  const AP4_UI08 *data;
+  if (!reader.Get(sidxBegin, sidxSize, data))
+  {
+    xbmc->Log(ADDON::LOG_ERROR, "Download SIDX retrieval failed");
+    return false;
+  }
+  if (!AddSidxSegments(data, sidxBegin, sidxSize, 0, rep, adp))
+    return false;
+
+  xbmc->Log(ADDON::LOG_DEBUG, "SIDX loaded with %u range requests, %u sub indexes pending",
+    reader.GetRequests(), static_cast<unsigned int>(rep->subIndexes_.size()));
+
+  // Top level index of a hierarchical SIDX, we need at least the first segments
+  while (rep->segments_.empty() && !rep->subIndexes_.empty())
+    if (!parseSubIndex())
+      return false;
+  return !rep->segments_.empty();
+}
+
+bool KodiAdaptiveStream::parseSubIndex()
+{
+  adaptive::AdaptiveTree::Representation *rep(const_cast<adaptive::AdaptiveTree::Representation*>(getRepresentation()));
+  adaptive::AdaptiveTree::AdaptationSet *adp(const_cast<adaptive::AdaptiveTree::AdaptationSet*>(getAdaptationSet()));
+
+  if (rep->subIndexes_.empty())
+    return false;
+
+  // The referenced range starts with the sub index, followed by the media it describes
+  adaptive::AdaptiveTree::Segment subIndex(rep->subIndexes_.front());
+  rep->subIndexes_.erase(rep->subIndexes_.begin());
+
+  IndexRangeReader reader(rep->url_);
+  uint64_t size;
+  AP4_UI32 type;
+  const AP4_UI08 *data;
+  if (!reader.GetBoxHeader(subIndex.range_begin_, size, type) || type != AP4_ATOM_TYPE_SIDX
+    || !reader.Get(subIndex.range_begin_, size, data))
+  {
+    xbmc->Log(ADDON::LOG_ERROR, "Download of sub SIDX at %" PRIu64 " failed", subIndex.range_begin_);
+    return false;
+  }
+  return AddSidxSegments(data, subIndex.range_begin_, size, subIndex.startPTS_, rep, adp);
+}
+
 /*******************************************************
 |   CodecHandler
 ********************************************************/
@@ -735,16 +959,27 @@ public:
   virtual bool GetInformation(INPUTSTREAM_INFO &info) = 0;
   virtual bool TimeSeek(uint64_t pts, bool preceeding) = 0;
   virtual void SetPTSOffset(uint64_t offset) = 0;
+  virtual void SetPeriodOffset(int64_t offset) = 0;
   virtual bool GetNextFragmentInfo(uint64_t &ts, uint64_t &dur) = 0;
   virtual uint32_t GetTimeScale()const = 0;
   virtual AP4_UI32 GetStreamId()const = 0;
+  // Buffer size ReadSampleData needs for the current sample, the sample itself may be smaller
   virtual AP4_Size GetSampleDataSize()const = 0;
-  virtual const AP4_Byte *GetSampleData()const = 0;
+  // Writes the current sample into buffer and returns its size
+  virtual AP4_Size ReadSampleData(AP4_Byte *buffer, AP4_Size bufferSize) = 0;
   virtual uint64_t GetDuration()const = 0;
   virtual bool IsEncrypted()const = 0;
   virtual void AddStreamType(INPUTSTREAM_INFO::STREAM_TYPE type, uint16_t sid) {};
   virtual void SetStreamType(INPUTSTREAM_INFO::STREAM_TYPE type, uint16_t sid) {};
   virtual bool RemoveStreamType(INPUTSTREAM_INFO::STREAM_TYPE type) { return true; };
+  // Readers demuxing ahead in a thread of their own (see ThreadedSampleReader)
+  virtual bool IsThreaded()const { return false; };
+  // Stops background reading, required before the underlying stream is touched from outside
+  virtual void Suspend() {};
+  // Readers raise this flag if GetInformation may report changed stream properties
+  bool CheckInfoChange() { bool ret(m_infoChanged); m_infoChanged = false; return ret; };
+protected:
+  bool m_infoChanged = false;
 };
 
 
@@ -762,6 +997,8 @@ public:
     , m_streamId(streamId)
     , m_sampleDescIndex(1)
     , m_bSampleDescChanged(false)
+    , m_directRead(true)
+    , m_decryptPending(false)
     , m_decrypterCaps(dcaps)
     , m_failCount(0)
     , m_eos(false)
@@ -770,6 +1007,7 @@ public:
     , m_pts(0)
     , m_ptsDiff(0)
     , m_ptsOffs(~0ULL)
+    , m_periodOffs(0)
     , m_codecHandler(0)
     , m_defaultKey(0)
     , m_protectedDesc(0)
@@ -839,6 +1077,14 @@ public:
   virtual AP4_Result ReadSample() override
   {
     AP4_Result result;
+    // A skipped sample still has to pass the decrypter to keep its sample cursor in step
+    if (m_decryptPending)
+    {
+      m_decryptPending = false;
+      if (AP4_FAILED(result = DecryptSample(m_sampleData)))
+        return result;
+    }
+
     if (!m_codecHandler || !m_codecHandler->ReadNextSample(m_sample, m_sampleData))
     {
       bool useDecryptingDecoder = m_protectedDesc && (m_decrypterCaps.flags & SSD::SSD_DECRYPTER::SSD_CAPS::SSD_SECURE_PATH) != 0;
@@ -860,25 +1106,14 @@ public:
       else if (decrypterPresent && m_decrypter == nullptr && !useDecryptingDecoder)
         m_sampleData.SetData(m_encrypted.GetData(), m_encrypted.GetDataSize());
 
+      m_decryptPending = false;
       if (m_decrypter)
       {
-        // Make sure that the decrypter is NOT allocating memory!
-        // If decrypter and addon are compiled with different DEBUG / RELEASE
-        // options freeing HEAP memory will fail.
-        m_sampleData.Reserve(m_encrypted.GetDataSize() + 4096);
-        if (AP4_FAILED(result = m_decrypter->DecryptSampleData(m_poolId, m_encrypted, m_sampleData, NULL)))
-        {
-          xbmc->Log(ADDON::LOG_ERROR, "Decrypt Sample returns failure!");
-          if (++m_failCount > 50)
-          {
-            Reset(true);
-            return result;
-          }
-          else
-            m_sampleData.SetDataSize(0);
-        }
-        else
-          m_failCount = 0;
+        // Samples passed on unchanged get decrypted when the caller provides its buffer
+        if (m_directRead)
+          m_decryptPending = true;
+        else if (AP4_FAILED(result = DecryptSample(m_sampleData)))
+          return result;
       }
       else if (useDecryptingDecoder)
       {
@@ -886,12 +1121,12 @@ public:
         m_singleSampleDecryptor->DecryptSampleData(m_poolId, m_encrypted, m_sampleData, nullptr, 0, nullptr, nullptr);
       }
 
-      if (m_codecHandler->Transform(m_sampleData, m_track->GetMediaTimeScale(), (m_ptsOffs * m_timeBaseInt) / m_timeBaseExt))
+      if (!m_decryptPending && m_codecHandler->Transform(m_sampleData, m_track->GetMediaTimeScale(), ((m_ptsOffs - m_periodOffs) * m_timeBaseInt) / m_timeBaseExt))
         m_codecHandler->ReadNextSample(m_sample, m_sampleData);
     }
 
-    m_dts = (m_sample.GetDts() * m_timeBaseExt) / m_timeBaseInt;
-    m_pts = (m_sample.GetCts() * m_timeBaseExt) / m_timeBaseInt;
+    m_dts = (m_sample.GetDts() * m_timeBaseExt) / m_timeBaseInt + m_periodOffs;
+    m_pts = (m_sample.GetCts() * m_timeBaseExt) / m_timeBaseInt + m_periodOffs;
 
     if (~m_ptsOffs)
     {
@@ -899,7 +1134,10 @@ public:
       m_ptsOffs = ~0ULL;
     }
 
-    m_codecHandler->UpdatePPSId(m_sampleData);
+    // Slice headers stay unencrypted, a pending sample can be inspected before decryption
+    m_codecHandler->UpdatePPSId(m_decryptPending ? m_encrypted : m_sampleData);
+    if (m_codecHandler->pictureId != m_codecHandler->pictureIdPrev)
+      m_infoChanged = true;
 
     return AP4_SUCCESS;
   };
@@ -908,6 +1146,7 @@ public:
   {
     AP4_LinearReader::Reset();
     m_eos = bEOS;
+    m_decryptPending = false;
   }
 
   virtual bool EOS() const  override { return m_eos; };
@@ -921,8 +1160,29 @@ public:
   };
 
   virtual AP4_UI32 GetStreamId()const override { return m_streamId; };
-  virtual AP4_Size GetSampleDataSize()const override { return m_sampleData.GetDataSize(); };
-  virtual const AP4_Byte *GetSampleData()const override { return m_sampleData.GetData(); };
+  virtual AP4_Size GetSampleDataSize()const override
+  {
+    return m_decryptPending ? m_encrypted.GetDataSize() + DECRYPT_RESERVE : m_sampleData.GetDataSize();
+  };
+
+  virtual AP4_Size ReadSampleData(AP4_Byte *buffer, AP4_Size bufferSize) override
+  {
+    if (!m_decryptPending)
+    {
+      AP4_Size size(m_sampleData.GetDataSize() < bufferSize ? m_sampleData.GetDataSize() : bufferSize);
+      memcpy(buffer, m_sampleData.GetData(), size);
+      return size;
+    }
+
+    // Decrypt straight into the caller's memory
+    m_decryptPending = false;
+    AP4_DataBuffer sampleData;
+    sampleData.SetBuffer(buffer, bufferSize);
+    if (AP4_FAILED(DecryptSample(sampleData)))
+      return 0;
+    return sampleData.GetDataSize();
+  };
+
   virtual uint64_t GetDuration()const override { return (m_sample.GetDuration() * m_timeBaseExt) / m_timeBaseInt; };
   virtual bool IsEncrypted()const override { return (m_decrypterCaps.flags & SSD::SSD_DECRYPTER::SSD_CAPS::SSD_SECURE_PATH) != 0 && m_decrypter != nullptr; };
   virtual bool GetInformation(INPUTSTREAM_INFO &info) override
@@ -953,9 +1213,10 @@ public:
   virtual bool TimeSeek(uint64_t  pts, bool preceeding) override
   {
     AP4_Ordinal sampleIndex;
-    AP4_UI64 seekPos(static_cast<AP4_UI64>(((pts + m_ptsDiff) * m_timeBaseInt) / m_timeBaseExt));
+    AP4_UI64 seekPos(static_cast<AP4_UI64>(((pts + m_ptsDiff - m_periodOffs) * m_timeBaseInt) / m_timeBaseExt));
     if (AP4_SUCCEEDED(SeekSample(m_track->GetId(), seekPos, sampleIndex, preceeding)))
     {
+      m_decryptPending = false;
       if (m_decrypter)
         m_decrypter->SetSampleIndex(sampleIndex);
       if (m_codecHandler)
@@ -968,10 +1229,12 @@ public:
 
   virtual void SetPTSOffset(uint64_t offset) override
   {
-    FindTracker(m_track->GetId())->m_NextDts = (offset * m_timeBaseInt) / m_timeBaseExt;
+    FindTracker(m_track->GetId())->m_NextDts = ((offset - m_periodOffs) * m_timeBaseInt) / m_timeBaseExt;
     m_ptsOffs = offset;
   };
 
+  virtual void SetPeriodOffset(int64_t offset) override { m_periodOffs = offset; };
+
   virtual bool GetNextFragmentInfo(uint64_t &ts, uint64_t &dur) override
   {
     if (m_nextDuration)
@@ -1059,13 +1322,38 @@ SUCCESS:
   }
 
 private:
+  // Decrypters may write slightly more than the encrypted sample size
+  static const AP4_Size DECRYPT_RESERVE = 4096;
+
+  AP4_Result DecryptSample(AP4_DataBuffer &sampleData)
+  {
+    // Make sure that the decrypter is NOT allocating memory!
+    // If decrypter and addon are compiled with different DEBUG / RELEASE
+    // options freeing HEAP memory will fail.
+    sampleData.Reserve(m_encrypted.GetDataSize() + DECRYPT_RESERVE);
+    AP4_Result result;
+    if (AP4_FAILED(result = m_decrypter->DecryptSampleData(m_poolId, m_encrypted, sampleData, NULL)))
+    {
+      xbmc->Log(ADDON::LOG_ERROR, "Decrypt Sample returns failure!");
+      if (++m_failCount > 50)
+      {
+        Reset(true);
+        return result;
+      }
+      sampleData.SetDataSize(0);
+    }
+    else
+      m_failCount = 0;
+    return AP4_SUCCESS;
+  }
 
   void UpdateSampleDescription()
   {
     if (m_codecHandler)
       delete m_codecHandler;
     m_codecHandler = 0;
-    m_bSampleDescChanged = true;
+    m_bSampleDescChanged = m_infoChanged = true;
+    m_directRead = true;
 
     AP4_SampleDescription *desc(m_track->GetSampleDescription(m_sampleDescIndex - 1));
     if (desc->GetType() == AP4_SampleDescription::TYPE_PROTECTED)
@@ -1090,6 +1378,7 @@ private:
       break;
     case AP4_SAMPLE_FORMAT_STPP:
       m_codecHandler = new TTMLCodecHandler(desc);
+      m_directRead = false;
       break;
     default:
       m_codecHandler = new CodecHandler(desc);
@@ -1105,6 +1394,8 @@ private:
   AP4_UI32 m_streamId;
   AP4_UI32 m_sampleDescIndex;
   bool m_bSampleDescChanged;
+  // The codec handler passes samples unchanged, m_encrypted holds a sample not yet decrypted
+  bool m_directRead, m_decryptPending;
   SSD::SSD_DECRYPTER::SSD_CAPS m_decrypterCaps;
   unsigned int m_failCount;
   AP4_UI32 m_poolId;
@@ -1112,6 +1403,7 @@ private:
   bool m_eos, m_started;
   int64_t m_dts, m_pts, m_ptsDiff;
   AP4_UI64 m_ptsOffs;
+  int64_t m_periodOffs;
 
   uint64_t m_timeBaseExt, m_timeBaseInt;
 
@@ -1136,6 +1428,7 @@ class SubtitleSampleReader : public SampleReader
 public:
   SubtitleSampleReader(const std::string &url, AP4_UI32 streamId)
     : m_pts(0)
+    , m_periodOffs(0)
     , m_streamId(streamId)
     , m_eos(false)
     , m_codecHandler(nullptr)
@@ -1171,7 +1464,7 @@ public:
   {
     if (m_codecHandler.ReadNextSample(m_sample, m_sampleData))
     {
-      m_pts = m_sample.GetCts() * 1000;
+      m_pts = static_cast<uint64_t>(static_cast<int64_t>(m_sample.GetCts() * 1000) + m_periodOffs);
       return AP4_SUCCESS;
     }
     m_eos = true;
@@ -1181,20 +1474,28 @@ public:
   virtual bool GetInformation(INPUTSTREAM_INFO &info) override { return false; };
   virtual bool TimeSeek(uint64_t  pts, bool preceeding) override
   {
-    if (m_codecHandler.TimeSeek(pts / 1000))
+    int64_t filePts(static_cast<int64_t>(pts) - m_periodOffs);
+    if (m_codecHandler.TimeSeek(filePts > 0 ? filePts / 1000 : 0))
       return AP4_SUCCEEDED(ReadSample());
     return false;
   };
   virtual void SetPTSOffset(uint64_t offset) override {};
+  virtual void SetPeriodOffset(int64_t offset) override { m_periodOffs = offset; };
   virtual bool GetNextFragmentInfo(uint64_t &ts, uint64_t &dur) override { return false; };
   virtual uint32_t GetTimeScale()const override { return 1000; };
   virtual AP4_UI32 GetStreamId()const override { return m_streamId; };
   virtual AP4_Size GetSampleDataSize()const override { return m_sampleData.GetDataSize(); };
-  virtual const AP4_Byte *GetSampleData()const override { return m_sampleData.GetData(); };
+  virtual AP4_Size ReadSampleData(AP4_Byte *buffer, AP4_Size bufferSize) override
+  {
+    memcpy(buffer, m_sampleData.GetData(), m_sampleData.GetDataSize());
+    return m_sampleData.GetDataSize();
+  };
   virtual uint64_t GetDuration()const override { return m_sample.GetDuration() * 1000; };
   virtual bool IsEncrypted()const override { return false; };
 private:
   uint64_t m_pts;
+  // Subtitle files of later periods start at 0, shifted onto the timeline of the first period
+  int64_t m_periodOffs;
   AP4_UI32 m_streamId;
   bool m_eos;
 
@@ -1212,6 +1513,7 @@ class TSSampleReader : public SampleReader, public TSReader
 public:
   TSSampleReader(AP4_ByteStream *input, INPUTSTREAM_INFO::STREAM_TYPE type, AP4_UI32 streamId, uint32_t requiredMask)
     : TSReader(input, requiredMask)
+    , m_input(static_cast<AP4_DASHStream*>(input))
     , m_typeMask(1 << type)
   {
     m_typeMap[type] = streamId;
@@ -1268,8 +1570,8 @@ public:
   {
     if (ReadPacket())
     {
-      m_dts = (GetDts() == PTS_UNSET) ? DVD_NOPTS_VALUE : (GetDts() * 100) / 9;
-      m_pts = (GetPts() == PTS_UNSET) ? DVD_NOPTS_VALUE : (GetPts() * 100) / 9;
+      m_dts = (GetDts() == PTS_UNSET) ? DVD_NOPTS_VALUE : (GetDts() * 100) / 9 + m_periodOffs;
+      m_pts = (GetPts() == PTS_UNSET) ? DVD_NOPTS_VALUE : (GetPts() * 100) / 9 + m_periodOffs;
 
       if (~m_ptsOffs)
       {
@@ -1298,7 +1600,7 @@ public:
     if (!StartStreaming(m_typeMask))
       return false;
 
-    AP4_UI64 seekPos(((pts + m_ptsDiff ) * 9) / 100);
+    AP4_UI64 seekPos(((pts + m_ptsDiff - m_periodOffs) * 9) / 100);
     if (TSReader::SeekTime(seekPos, preceeding))
     {
       m_started = true;
@@ -1312,15 +1614,30 @@ public:
     m_ptsOffs = offset;
   }
 
+  virtual void SetPeriodOffset(int64_t offset) override { m_periodOffs = offset; }
+
   virtual bool GetNextFragmentInfo(uint64_t &ts, uint64_t &dur) override { return false; }
   virtual uint32_t GetTimeScale()const override { return 90000; }
   virtual AP4_UI32 GetStreamId()const override { return m_typeMap[GetStreamType()]; }
   virtual AP4_Size GetSampleDataSize()const override { return GetPacketSize(); }
-  virtual const AP4_Byte *GetSampleData()const override { return GetPacketData(); }
+  virtual AP4_Size ReadSampleData(AP4_Byte *buffer, AP4_Size bufferSize) override
+  {
+    memcpy(buffer, GetPacketData(), GetPacketSize());
+    return GetPacketSize();
+  }
   virtual uint64_t GetDuration()const override { return (TSReader::GetDuration() * 100) / 9; }
   virtual bool IsEncrypted()const override { return false; };
 
 private:
+  virtual void OnStreamInfoChanged() override { m_infoChanged = true; };
+  // TS is a plain byte stream, blocks may take what is available and cross segments
+  virtual size_t ReadAvailable(unsigned char *data, size_t maxLen) override
+  {
+    AP4_Size bytesRead;
+    return AP4_SUCCEEDED(m_input->ReadAvailable(data, static_cast<AP4_Size>(maxLen), bytesRead)) ? bytesRead : 0;
+  };
+
+  AP4_DASHStream *m_input; //Session streams always read through AP4_DASHStream
   uint32_t m_typeMask; //Bit representation of INPUTSTREAM_INFO::STREAM_TYPES
   uint16_t m_typeMap[16];
   bool m_eos = false;
@@ -1330,6 +1647,294 @@ private:
   uint64_t m_dts = 0;
   int64_t m_ptsDiff = 0;
   uint64_t m_ptsOffs = ~0ULL;
+  int64_t m_periodOffs = 0;
+};
+
+/*******************************************************
+|   ThreadedSampleReader
+********************************************************/
+// Runs another reader ahead in a thread of its own: demuxing, decryption and
+// codec transforms fill a bounded single producer / single consumer packet queue.
+class ThreadedSampleReader : public SampleReader
+{
+public:
+  ThreadedSampleReader(SampleReader *reader, Session &session, Session::STREAM &stream)
+    : m_reader(reader)
+    , m_session(session)
+    , m_stream(stream)
+    , m_head(0)
+    , m_tail(0)
+    , m_eos(reader->EOS())
+    , m_stop(false)
+    , m_result(AP4_SUCCESS)
+    , m_ptsOffset(0)
+    , m_ptsOffsetPending(false)
+    , m_info()
+  {
+    CopyInformation(m_info, stream.info_);
+  };
+
+  ~ThreadedSampleReader()
+  {
+    Suspend();
+    delete m_reader;
+    free((void*)(m_info.m_ExtraData));
+  };
+
+  virtual bool IsThreaded()const override { return true; };
+
+  virtual void Suspend() override
+  {
+    // Calls from inside the worker go straight through
+    if (!m_worker.joinable() || m_worker.get_id() == std::this_thread::get_id())
+      return;
+    m_stop = true;
+    m_signalSpace.notify_one();
+    m_worker.join();
+    m_stop = false;
+  };
+
+  // The consumer only finds the queue empty while the worker is not running (see ReadSample),
+  // then the wrapped reader is positioned on the last sample handed out and can be asked directly
+  virtual bool EOS()const override { return Empty() && m_eos; };
+  virtual uint64_t DTS()const override { return Empty() ? m_reader->DTS() : Head().dts_; };
+  virtual uint64_t PTS()const override { return Empty() ? m_reader->PTS() : Head().pts_; };
+  virtual uint64_t Elapsed(uint64_t basePTS) override
+  {
+    uint64_t elapsed(Empty() ? m_reader->Elapsed(0) : Head().elapsed_);
+    return elapsed > basePTS ? elapsed - basePTS : 0;
+  };
+
+  virtual AP4_Result Start(bool &bStarted) override
+  {
+    bStarted = false;
+    if (!Empty() || m_eos)
+      return AP4_SUCCESS;
+
+    Suspend();
+    CopyInformation(m_info, m_stream.info_);
+    ApplyPTSOffset();
+    AP4_Result result(m_reader->Start(bStarted));
+    // The session asks for the stream information right after starting
+    if (bStarted && !m_reader->EOS())
+      Capture(true);
+    m_eos = m_reader->EOS();
+    return result;
+  };
+
+  virtual AP4_Result ReadSample() override
+  {
+    if (!Empty())
+    {
+      m_head.store(m_head.load() + 1, std::memory_order_release);
+      m_signalSpace.notify_one();
+    }
+
+    if (!m_eos && !m_worker.joinable())
+      m_worker = std::thread(&ThreadedSampleReader::Worker, this);
+
+    if (Empty())
+    {
+      std::unique_lock<std::mutex> lck(m_mutex);
+      m_signalData.wait(lck, [this]() { return !Empty() || m_eos || AP4_FAILED(m_result); });
+    }
+    if (Empty())
+    {
+      // Join the finished worker before the wrapped reader gets asked directly
+      Suspend();
+      if (m_eos)
+        return AP4_ERROR_EOS;
+      // The worker stopped at a failing sample, report it once, the next call retries
+      AP4_Result result(m_result);
+      m_result = AP4_SUCCESS;
+      return result;
+    }
+
+    m_infoChanged = Head().infoChanged_;
+    return AP4_SUCCESS;
+  };
+
+  virtual void Reset(bool bEOS) override
+  {
+    Suspend();
+    Flush();
+    m_reader->Reset(bEOS);
+    m_eos = bEOS;
+  };
+
+  virtual bool GetInformation(INPUTSTREAM_INFO &info) override
+  {
+    // Changes of our stream arrive with the packet they belong to, the wrapped reader is ahead
+    if (!Empty() && &info == &m_stream.info_)
+    {
+      if (!Head().infoChanged_)
+        return false;
+      CopyInformation(info, Head().info_);
+      return true;
+    }
+    Suspend();
+    return m_reader->GetInformation(info);
+  };
+
+  virtual bool TimeSeek(uint64_t pts, bool preceeding) override
+  {
+    Suspend();
+    Flush();
+    ApplyPTSOffset();
+    bool ret(m_reader->TimeSeek(pts, preceeding));
+    if (ret && !m_reader->EOS())
+      Capture();
+    m_eos = m_reader->EOS();
+    return ret;
+  };
+
+  // Arrives from the stream's download thread while the worker may be reading, it is applied before the next sample
+  virtual void SetPTSOffset(uint64_t offset) override
+  {
+    m_ptsOffset = offset;
+    m_ptsOffsetPending = true;
+  };
+  virtual void SetPeriodOffset(int64_t offset) override { Suspend(); m_reader->SetPeriodOffset(offset); };
+  virtual bool GetNextFragmentInfo(uint64_t &ts, uint64_t &dur) override { Suspend(); return m_reader->GetNextFragmentInfo(ts, dur); };
+  virtual uint32_t GetTimeScale()const override { return Empty() ? m_reader->GetTimeScale() : Head().timeScale_; };
+  virtual AP4_UI32 GetStreamId()const override { return Empty() ? m_reader->GetStreamId() : Head().streamId_; };
+  virtual AP4_Size GetSampleDataSize()const override { return Empty() ? 0 : Head().data_.GetDataSize(); };
+  virtual AP4_Size ReadSampleData(AP4_Byte *buffer, AP4_Size bufferSize) override
+  {
+    if (Empty())
+      return 0;
+    const AP4_DataBuffer &data(Head().data_);
+    AP4_Size size(data.GetDataSize() < bufferSize ? data.GetDataSize() : bufferSize);
+    memcpy(buffer, data.GetData(), size);
+    return size;
+  };
+  virtual uint64_t GetDuration()const override { return Empty() ? m_reader->GetDuration() : Head().duration_; };
+  virtual bool IsEncrypted()const override { return Empty() ? m_reader->IsEncrypted() : Head().encrypted_; };
+  virtual void AddStreamType(INPUTSTREAM_INFO::STREAM_TYPE type, uint16_t sid) override { Suspend(); m_reader->AddStreamType(type, sid); };
+  virtual void SetStreamType(INPUTSTREAM_INFO::STREAM_TYPE type, uint16_t sid) override { Suspend(); m_reader->SetStreamType(type, sid); };
+  virtual bool RemoveStreamType(INPUTSTREAM_INFO::STREAM_TYPE type) override { Suspend(); return m_reader->RemoveStreamType(type); };
+
+private:
+  static const size_t MAX_QUEUED_PACKETS = 32;
+
+  struct PACKET
+  {
+    PACKET() :info_() {};
+    ~PACKET() { free((void*)(info_.m_ExtraData)); };
+
+    uint64_t dts_, pts_, duration_, elapsed_;
+    AP4_UI32 streamId_;
+    uint32_t timeScale_;
+    bool encrypted_;
+    // info_ holds the stream information valid from this packet on if infoChanged_ is set
+    bool infoChanged_;
+    INPUTSTREAM_INFO info_;
+    AP4_DataBuffer data_;
+  };
+
+  // Deep copy, extra data is owned by each INPUTSTREAM_INFO
+  static void CopyInformation(INPUTSTREAM_INFO &dst, const INPUTSTREAM_INFO &src)
+  {
+    free((void*)(dst.m_ExtraData));
+    dst = src;
+    if (src.m_ExtraSize)
+    {
+      dst.m_ExtraData = (const uint8_t*)malloc(src.m_ExtraSize);
+      memcpy((void*)dst.m_ExtraData, src.m_ExtraData, src.m_ExtraSize);
+    }
+    else
+      dst.m_ExtraData = nullptr;
+  }
+
+  bool Empty() const { return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire); };
+  bool Full() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire) >= MAX_QUEUED_PACKETS; };
+  const PACKET &Head() const { return m_packets[m_head.load(std::memory_order_relaxed) % MAX_QUEUED_PACKETS]; };
+
+  // Only while the worker is not running
+  void Flush()
+  {
+    m_head.store(m_tail.load());
+    m_result = AP4_SUCCESS;
+  };
+
+  // From the thread reading the wrapped reader
+  void ApplyPTSOffset()
+  {
+    if (m_ptsOffsetPending.exchange(false))
+      m_reader->SetPTSOffset(m_ptsOffset);
+  };
+
+  // Queues the sample the wrapped reader is positioned on
+  void Capture(bool checkInfo = false)
+  {
+    m_session.CheckFragmentDuration(m_stream);
+
+    PACKET &packet(m_packets[m_tail.load(std::memory_order_relaxed) % MAX_QUEUED_PACKETS]);
+    packet.dts_ = m_reader->DTS();
+    packet.pts_ = m_reader->PTS();
+    packet.duration_ = m_reader->GetDuration();
+    packet.elapsed_ = m_reader->Elapsed(0);
+    packet.streamId_ = m_reader->GetStreamId();
+    packet.timeScale_ = m_reader->GetTimeScale();
+    packet.encrypted_ = m_reader->IsEncrypted();
+    bool infoChanged(m_reader->CheckInfoChange());
+    packet.infoChanged_ = (infoChanged || checkInfo) && m_reader->GetInformation(m_info);
+    if (packet.infoChanged_)
+      CopyInformation(packet.info_, m_info);
+    // The data buffer keeps its capacity for the next packets
+    AP4_Size size(m_reader->GetSampleDataSize());
+    packet.data_.Reserve(size);
+    packet.data_.SetDataSize(m_reader->ReadSampleData(packet.data_.UseData(), size));
+
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  };
+
+  void Worker()
+  {
+    while (!m_stop)
+    {
+      if (Full())
+      {
+        std::unique_lock<std::mutex> lck(m_mutex);
+        m_signalSpace.wait_for(lck, std::chrono::milliseconds(10), [this]() { return m_stop || !Full(); });
+        continue;
+      }
+      ApplyPTSOffset();
+      AP4_Result result(m_reader->ReadSample());
+      if (result == AP4_ERROR_EOS || m_reader->EOS())
+      {
+        m_eos = true;
+        break;
+      }
+      else if (AP4_FAILED(result))
+      {
+        m_result = result;
+        break;
+      }
+      Capture();
+      std::lock_guard<std::mutex> lck(m_mutex);
+      m_signalData.notify_one();
+    }
+    std::lock_guard<std::mutex> lck(m_mutex);
+    m_signalData.notify_one();
+  };
+
+  SampleReader *m_reader;
+  Session &m_session;
+  Session::STREAM &m_stream;
+
+  PACKET m_packets[MAX_QUEUED_PACKETS];
+  std::atomic<size_t> m_head, m_tail;
+  std::atomic<bool> m_eos, m_stop;
+  std::atomic<AP4_Result> m_result;
+  std::atomic<uint64_t> m_ptsOffset;
+  std::atomic<bool> m_ptsOffsetPending;
+  // Stream information as seen by the worker, updated while capturing
+  INPUTSTREAM_INFO m_info;
+
+  std::thread m_worker;
+  std::mutex m_mutex;
+  std::condition_variable m_signalData, m_signalSpace;
 };
 
 /*******************************************************
@@ -1340,7 +1945,11 @@ void Session::STREAM::disable()
 {
   if (enabled)
   {
+    // Wake up a reader running ahead inside stream_.read() before joining it
     stream_.stop();
+    if (reader_)
+      reader_->Suspend();
+    stream_.dispose();
     SAFE_DELETE(reader_);
     SAFE_DELETE(input_file_);
     SAFE_DELETE(input_);
@@ -1363,10 +1972,12 @@ Session::Session(MANIFEST_TYPE manifestType, const char *strURL, const char *str
   , decrypter_(0)
   , secure_video_session_(false)
   , adaptiveTree_(0)
+  , schedule_valid_(false)
   , width_(display_width)
   , height_(display_height)
   , changed_(false)
   , manual_streams_(false)
+  , demux_thread_(false)
   , elapsed_time_(0)
 {
   switch (manifest_type_)
@@ -1378,8 +1989,12 @@ Session::Session(MANIFEST_TYPE manifestType, const char *strURL, const char *str
     adaptiveTree_ = new adaptive::SmoothTree;
     break;
   case MANIFEST_TYPE_HLS:
-    adaptiveTree_ = new adaptive::HLSTree(new AESDecrypter(license_key_));
+  {
+    bool prefetch(false);
+    xbmc->GetSetting("HLSPREFETCH", (char*)&prefetch);
+    adaptiveTree_ = new adaptive::HLSTree(new AESDecrypter(license_key_), prefetch);
     break;
+  }
   default:;
   };
 
@@ -1411,6 +2026,9 @@ Session::Session(MANIFEST_TYPE manifestType, const char *strURL, const char *str
   xbmc->Log(ADDON::LOG_DEBUG, "STREAMSELECTION selected: %d ", buf);
   manual_streams_ = buf != 0;
 
+  xbmc->GetSetting("DEMUXTHREAD", (char*)&demux_thread_);
+  xbmc->Log(ADDON::LOG_DEBUG, "DEMUXTHREAD selected: %d ", demux_thread_ ? 1 : 0);
+
   xbmc->GetSetting("MEDIATYPE", (char*)&buf);
   switch (buf)
   {
@@ -1431,6 +2049,7 @@ Session::Session(MANIFEST_TYPE manifestType, const char *strURL, const char *str
     server_certificate_.SetDataSize(dstsz);
   }
   adaptiveTree_->manifest_headers_ = manifestHeaders;
+  adaptiveTree_->snapshot_path_ = profile_path_;
 
 }
 
@@ -1441,6 +2060,13 @@ Session::~Session()
     SAFE_DELETE(*b);
   streams_.clear();
 
+  for (std::map<std::string, CACHEDMOVIE>::iterator b(movie_cache_.begin()), e(movie_cache_.end()); b != e; ++b)
+  {
+    delete b->second.movie_;
+    b->second.init_->Release();
+  }
+  movie_cache_.clear();
+
   DisposeDecrypter();
 
   std::string fn(profile_path_ + "bandwidth.bin");
@@ -1644,8 +2270,12 @@ bool Session::initialize()
           stream.stream_.select_stream(true, false, stream.info_.m_pID >> 16);
 
           stream.input_ = new AP4_DASHStream(&stream.stream_);
-          stream.input_file_ = new AP4_File(*stream.input_, AP4_DefaultAtomFactory::Instance, true);
-          AP4_Movie* movie = stream.input_file_->GetMovie();
+          AP4_Movie* movie = GetCachedMovie(stream);
+          if (!movie)
+          {
+            stream.input_file_ = new AP4_File(*stream.input_, AP4_DefaultAtomFactory::Instance, true);
+            movie = stream.input_file_->GetMovie();
+          }
           if (movie == NULL)
           {
             xbmc->Log(ADDON::LOG_ERROR, "No MOOV in stream!");
@@ -1947,6 +2577,7 @@ AP4_Movie *Session::PrepareStream(STREAM *stream)
 
 void Session::AlignStreams()
 {
+  InvalidateSchedule();
   uint64_t maxDts = 0;
   STREAM *res(0), *waiting(0);
   for (std::vector<STREAM*>::const_iterator b(streams_.begin()), e(streams_.end()); b != e; ++b)
@@ -1982,24 +2613,56 @@ void Session::AlignStreams()
 
 }
 
-SampleReader *Session::GetNextSample()
+void Session::ScheduleStream(unsigned int pos)
 {
-  STREAM *res(0);
-  for (std::vector<STREAM*>::const_iterator b(streams_.begin()), e(streams_.end()); b != e; ++b)
+  STREAM *stream(streams_[pos]);
+  bool bStarted(false);
+  // Readers run dry at the end of a period, continue with the following one
+  if (stream->enabled && stream->reader_ && stream->reader_->EOS() && stream->stream_.has_next_period())
+    StartNextPeriod(*stream);
+
+  if (!stream->enabled || !stream->reader_ || stream->reader_->EOS())
+    return;
+
+  bool ready(AP4_SUCCEEDED(stream->reader_->Start(bStarted)));
+
+  if (bStarted && stream->reader_->GetInformation(stream->info_))
+    changed_ = true;
+
+  if (ready)
   {
-    bool bStarted(false);
-    if ((*b)->enabled && (*b)->reader_ && !(*b)->reader_->EOS() && AP4_SUCCEEDED((*b)->reader_->Start(bStarted))
-      && (!res || (*b)->reader_->DTS() < res->reader_->DTS()))
-      res = *b;
+    schedule_.push_back(std::make_pair(stream->reader_->DTS(), pos));
+    std::push_heap(schedule_.begin(), schedule_.end(), std::greater<std::pair<uint64_t, unsigned int> >());
+  }
+  else // Give it another try with the next sample
+    schedule_valid_ = false;
+}
 
-    if (bStarted && ((*b)->reader_->GetInformation((*b)->info_)))
-      changed_ = true;
+SampleReader *Session::GetNextSample()
+{
+  if (!schedule_valid_)
+  {
+    schedule_valid_ = true;
+    schedule_.clear();
+    for (unsigned int i(0); i < streams_.size(); ++i)
+      ScheduleStream(i);
+  }
+  else if (!schedule_.empty())
+  {
+    // The reader we returned last time has moved on to its next sample
+    std::pop_heap(schedule_.begin(), schedule_.end(), std::greater<std::pair<uint64_t, unsigned int> >());
+    unsigned int pos(schedule_.back().second);
+    schedule_.pop_back();
+    ScheduleStream(pos);
   }
 
+  STREAM *res(schedule_.empty() ? nullptr : streams_[schedule_.front().second]);
   if (res)
   {
-    CheckFragmentDuration(*res);
-    if (res->reader_->GetInformation(res->info_))
+    // Threaded readers check their fragments while they run ahead
+    if (!res->reader_->IsThreaded())
+      CheckFragmentDuration(*res);
+    if (res->reader_->CheckInfoChange() && res->reader_->GetInformation(res->info_))
       changed_ = true;
     if (res->reader_->PTS() != DVD_NOPTS_VALUE)
       elapsed_time_ = res->reader_->Elapsed(res->stream_.GetStartPTS());
@@ -2016,17 +2679,39 @@ bool Session::SeekTime(double seekTime, unsigned int streamId, bool preceeding)
   if (seekTime < 0)
     seekTime = 0;
 
-  if (adaptiveTree_->has_timeshift_buffer_ && seekTime > (static_cast<double>(GetTotalTimeMs()) / 1000) - 12)
+  InvalidateSchedule();
+
+  // Seeking to the live edge lets playback follow it again
+  bool liveEdge(false);
+  if (adaptiveTree_->has_timeshift_buffer_)
   {
-    seekTime = (static_cast<double>(GetTotalTimeMs()) / 1000) - 12;
-    preceeding = true;
+    uint32_t liveDelay(0);
+    for (std::vector<STREAM*>::const_iterator b(streams_.begin()), e(streams_.end()); b != e; ++b)
+      if ((*b)->enabled && (*b)->stream_.getLiveDelay() > liveDelay)
+        liveDelay = (*b)->stream_.getLiveDelay();
+
+    if (seekTime >= (static_cast<double>(GetTotalTimeMs()) / 1000) - liveDelay)
+    {
+      seekTime = (static_cast<double>(GetTotalTimeMs()) / 1000) - liveDelay;
+      preceeding = true;
+      liveEdge = true;
+    }
   }
 
   for (std::vector<STREAM*>::const_iterator b(streams_.begin()), e(streams_.end()); b != e; ++b)
     if ((*b)->enabled && (*b)->reader_ && (streamId == 0 || (*b)->info_.m_pID == streamId))
     {
-      bool bReset;
+      bool bReset(false);
+      (*b)->reader_->Suspend();
+      (*b)->stream_.set_live_anchored(liveEdge);
       uint64_t seekTimeCorrected = static_cast<uint64_t>(seekTime * DVD_TIME_BASE) + (*b)->stream_.GetStartPTS();
+      // Targets in another period are reached by switching over to it like at the end of a period
+      if ((*b)->stream_.seek_period(static_cast<double>(seekTimeCorrected) / DVD_TIME_BASE) && !StartNextPeriod(**b))
+      {
+        if ((*b)->reader_)
+          (*b)->reader_->Reset(true);
+        continue;
+      }
       if ((*b)->stream_.seek_time(static_cast<double>(seekTimeCorrected) / DVD_TIME_BASE, preceeding, bReset))
       {
         if (bReset)
@@ -2048,6 +2733,12 @@ bool Session::SeekTime(double seekTime, unsigned int streamId, bool preceeding)
   return ret;
 }
 
+void Session::SetLiveAnchored(bool anchored)
+{
+  for (std::vector<STREAM*>::const_iterator b(streams_.begin()), e(streams_.end()); b != e; ++b)
+    (*b)->stream_.set_live_anchored(anchored);
+}
+
 void Session::OnSegmentChanged(adaptive::AdaptiveStream *stream)
 {
   for (std::vector<STREAM*>::iterator s(streams_.begin()), e(streams_.end()); s != e; ++s)
@@ -2060,10 +2751,131 @@ void Session::OnSegmentChanged(adaptive::AdaptiveStream *stream)
     }
 }
 
+AP4_Movie *Session::GetCachedMovie(STREAM &stream)
+{
+  std::string key(stream.stream_.getInitKey(stream.stream_.getRepresentation()));
+  if (key.empty())
+    return nullptr;
+
+  std::map<std::string, CACHEDMOVIE>::const_iterator res(movie_cache_.find(key));
+  if (res != movie_cache_.end())
+    return res->second.movie_;
+
+  // The init segment was stored in the tree while the stream downloaded it
+  std::string data;
+  if (!adaptiveTree_->GetInitSegment(key, data))
+    return nullptr;
+
+  // Track sample tables keep a reference to the stream the movie was parsed from
+  CACHEDMOVIE entry;
+  entry.init_ = new AP4_MemoryByteStream(reinterpret_cast<const AP4_UI08*>(data.data()), static_cast<AP4_Size>(data.size()));
+  entry.movie_ = nullptr;
+
+  AP4_Atom *atom;
+  while (!entry.movie_ && AP4_SUCCEEDED(AP4_DefaultAtomFactory::Instance.CreateAtomFromStream(*entry.init_, atom)))
+  {
+    if (atom->GetType() == AP4_ATOM_TYPE_MOOV)
+      entry.movie_ = new AP4_Movie(AP4_DYNAMIC_CAST(AP4_MoovAtom, atom), *entry.init_, true);
+    else
+      delete atom;
+  }
+  if (!entry.movie_)
+  {
+    entry.init_->Release();
+    return nullptr;
+  }
+  movie_cache_[key] = entry;
+  return entry.movie_;
+}
+
 void Session::OnStreamChange(adaptive::AdaptiveStream *stream, uint32_t segment)
 {
 }
 
+bool Session::StartNextPeriod(STREAM &stream)
+{
+  const adaptive::AdaptiveTree::Representation *rep(stream.stream_.getRepresentation());
+  std::string codecs(rep->codecs_);
+  AP4_UI32 streamId(stream.reader_->GetStreamId());
+
+  if ((rep->flags_ & adaptive::AdaptiveTree::Representation::INCLUDEDSTREAM) || !stream.stream_.start_next_period())
+    return false;
+
+  rep = stream.stream_.getRepresentation();
+  xbmc->Log(ADDON::LOG_DEBUG, "Stream %u continues with next period (bandwidth: %u)", stream.info_.m_pID, rep->bandwidth_);
+
+  // The init segment of the new period may change codec configuration and track id
+  SAFE_DELETE(stream.reader_);
+  SAFE_DELETE(stream.input_file_);
+
+  if (rep->flags_ & adaptive::AdaptiveTree::Representation::SUBTITLESTREAM)
+  {
+    stream.reader_ = new SubtitleSampleReader(rep->url_, streamId);
+    stream.reader_->SetPeriodOffset(stream.stream_.GetPeriodOffset());
+    return true;
+  }
+  else if (rep->containerType_ == adaptive::AdaptiveTree::CONTAINERTYPE_TS)
+  {
+    stream.reader_ = new TSSampleReader(stream.input_, stream.info_.m_streamType, streamId,
+      (1U << stream.info_.m_streamType) | GetIncludedStreamMask());
+    if (!static_cast<TSSampleReader*>(stream.reader_)->Initialize())
+    {
+      stream.disable();
+      return false;
+    }
+    // Streams included in ours have to be registered with the new reader again
+    if (stream.info_.m_streamType == INPUTSTREAM_INFO::TYPE_VIDEO)
+      for (unsigned int i(0); i < streams_.size(); ++i)
+        if (streams_[i]->enabled
+          && (streams_[i]->stream_.getRepresentation()->flags_ & adaptive::AdaptiveTree::Representation::INCLUDEDSTREAM))
+        {
+          stream.reader_->AddStreamType(streams_[i]->info_.m_streamType, i + 1);
+          if (stream.reader_->GetInformation(streams_[i]->info_))
+            changed_ = true;
+        }
+  }
+  else if (rep->containerType_ == adaptive::AdaptiveTree::CONTAINERTYPE_MP4)
+  {
+    AP4_Movie *movie(PrepareStream(&stream));
+    if (movie || !(movie = GetCachedMovie(stream)))
+    {
+      stream.input_file_ = new AP4_File(*stream.input_, AP4_DefaultAtomFactory::Instance, true, movie);
+      movie = stream.input_file_->GetMovie();
+    }
+    AP4_Track *track(movie ? movie->GetTrack(TIDC[stream.stream_.get_type()]) : nullptr);
+    if (!track)
+    {
+      xbmc->Log(ADDON::LOG_ERROR, "No suitable track found in next period");
+      stream.disable();
+      return false;
+    }
+    stream.reader_ = new FragmentedSampleReader(stream.input_, movie, track, streamId,
+      GetSingleSampleDecryptor(rep->pssh_set_), GetDecrypterCaps(rep->pssh_set_));
+  }
+  else
+  {
+    stream.disable();
+    return false;
+  }
+  EnableDemuxThread(stream);
+
+  stream.reader_->SetPeriodOffset(stream.stream_.GetPeriodOffset());
+  stream.reader_->SetPTSOffset(stream.stream_.GetPTSOffset());
+
+  if (codecs != rep->codecs_)
+  {
+    UpdateStream(stream, GetDecrypterCaps(rep->pssh_set_));
+    changed_ = true;
+  }
+  return true;
+}
+
+void Session::EnableDemuxThread(STREAM &stream)
+{
+  if (demux_thread_ && stream.reader_)
+    stream.reader_ = new ThreadedSampleReader(stream.reader_, *this, stream);
+}
+
 void Session::CheckFragmentDuration(STREAM &stream)
 {
   uint64_t nextTs, nextDur;
@@ -2071,7 +2883,7 @@ void Session::CheckFragmentDuration(STREAM &stream)
     adaptiveTree_->SetFragmentDuration(
       stream.stream_.getAdaptationSet(),
       stream.stream_.getRepresentation(),
-      stream.stream_.getSegmentPos(),
+      stream.stream_.getSegment(),
       nextTs,
       static_cast<uint32_t>(nextDur),
       stream.reader_->GetTimeScale());
@@ -2260,6 +3072,7 @@ extern "C" {
     xbmc->Log(ADDON::LOG_DEBUG, "Open()");
 
     const char *lt(""), *lk(""), *ld(""), *lsc(""), *mfup("");
+    uint32_t liveDelay(0);
     std::map<std::string, std::string> manh, medh;
     std::string mpd_url = props.m_strURL;
     MANIFEST_TYPE manifest(MANIFEST_TYPE_UNKNOWN);
@@ -2307,6 +3120,11 @@ extern "C" {
         medh = manh;
         mpd_url = mpd_url.substr(0, mpd_url.find("|"));
       }
+      else if (strcmp(props.m_ListItemProperties[i].m_strKey, "inputstream.adaptive.live_delay") == 0)
+      {
+        xbmc->Log(ADDON::LOG_DEBUG, "found inputstream.adaptive.live_delay: %s", props.m_ListItemProperties[i].m_strValue);
+        liveDelay = atoi(props.m_ListItemProperties[i].m_strValue);
+      }
     }
 
     if (manifest == MANIFEST_TYPE_UNKNOWN)
@@ -2327,6 +3145,7 @@ extern "C" {
 
     m_session = new Session(manifest, mpd_url.c_str(), mfup, lt, lk, ld, lsc, manh, medh, props.m_profileFolder, m_width, m_height);
     m_session->SetVideoResolution(m_width, m_height);
+    m_session->SetLiveDelay(liveDelay);
 
     if (!m_session->initialize())
     {
@@ -2427,6 +3246,8 @@ extern "C" {
     if (!stream)
       return;
 
+    m_session->InvalidateSchedule();
+
     if (enable)
     {
       if (stream->enabled)
@@ -2502,8 +3323,12 @@ extern "C" {
       else if (rep->containerType_ == adaptive::AdaptiveTree::CONTAINERTYPE_MP4)
       {
         stream->input_ = new AP4_DASHStream(&stream->stream_);
-        stream->input_file_ = new AP4_File(*stream->input_, AP4_DefaultAtomFactory::Instance, true, movie);
-        movie = stream->input_file_->GetMovie();
+        // A movie we created from the manifest is owned by input_file_, a cached one by the session
+        if (movie || !(movie = m_session->GetCachedMovie(*stream)))
+        {
+          stream->input_file_ = new AP4_File(*stream->input_, AP4_DefaultAtomFactory::Instance, true, movie);
+          movie = stream->input_file_->GetMovie();
+        }
 
         if (movie == NULL)
         {
@@ -2539,6 +3364,7 @@ extern "C" {
       if (stream->reader_->GetInformation(stream->info_))
         m_session->CheckChange(true);
 
+      m_session->EnableDemuxThread(*stream);
       return;
     }
     else if (stream->enabled)
@@ -2608,14 +3434,14 @@ extern "C" {
 
     if (sr)
     {
-      DemuxPacket *p = ipsh->AllocateDemuxPacket(sr->GetSampleDataSize());
+      AP4_Size bufferSize(sr->GetSampleDataSize());
+      DemuxPacket *p = ipsh->AllocateDemuxPacket(bufferSize);
       p->dts = static_cast<double>(sr->DTS());
       p->pts = static_cast<double>(sr->PTS());
       p->duration = static_cast<double>(sr->GetDuration());
       p->iStreamId = sr->GetStreamId();
       p->iGroupId = 0;
-      p->iSize = sr->GetSampleDataSize();
-      memcpy(p->pData, sr->GetSampleData(), p->iSize);
+      p->iSize = sr->ReadSampleData(p->pData, bufferSize);
 
       //xbmc->Log(ADDON::LOG_DEBUG, "DTS: %0.4f, PTS:%0.4f, ID: %u SZ: %d", p->dts, p->pts, p->iStreamId, p->iSize);
 
@@ -2696,6 +3522,9 @@ extern "C" {
 
   void PauseStream(double)
   {
+    // After a pause we stay behind the live edge until the user seeks back to it
+    if (m_session)
+      m_session->SetLiveAnchored(false);
   }
 
   bool IsRealTimeStream()
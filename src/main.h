@@ -66,6 +66,7 @@ public:
 protected:
   virtual bool download(const char* url, const std::map<std::string, std::string> &mediaHeaders) override;
   virtual bool parseIndexRange() override;
+  virtual bool parseSubIndex() override;
 };
 
 enum MANIFEST_TYPE
@@ -105,7 +106,13 @@ public:
   };
 
   void UpdateStream(STREAM &stream, const SSD::SSD_DECRYPTER::SSD_CAPS &caps);
+  // Lets the stream's reader demux ahead in a thread of its own if enabled in settings
+  void EnableDemuxThread(STREAM &stream);
+  // Called for every sample a reader moves to
+  void CheckFragmentDuration(STREAM &stream);
   AP4_Movie *PrepareStream(STREAM *stream);
+  // Movie parsed from the stream's init segment, owned by the session and shared by all readers
+  AP4_Movie *GetCachedMovie(STREAM &stream);
 
   STREAM *GetStream(unsigned int sid)const { return sid - 1 < streams_.size() ? streams_[sid - 1] : 0; };
   unsigned int GetStreamCount() const { return streams_.size(); };
@@ -120,9 +127,13 @@ public:
   uint64_t GetTotalTimeMs()const { return adaptiveTree_->overallSeconds_ * 1000; };
   uint64_t GetElapsedTimeMs()const { return elapsed_time_ / 1000; };
   bool CheckChange(bool bSet = false){ bool ret = changed_; changed_ = bSet; return ret; };
+  // Has to be called whenever readers get created, removed or moved outside GetNextSample
+  void InvalidateSchedule() { schedule_valid_ = false; };
   void SetVideoResolution(unsigned int w, unsigned int h) { width_ = w; height_ = h;};
   bool SeekTime(double seekTime, unsigned int streamId = 0, bool preceeding=true);
   bool IsLive() const { return adaptiveTree_->has_timeshift_buffer_; };
+  void SetLiveDelay(uint32_t seconds) { adaptiveTree_->live_delay_ = seconds; };
+  void SetLiveAnchored(bool anchored);
   MANIFEST_TYPE GetManifestType() const { return manifest_type_; };
   const AP4_UI08 *GetDefaultKeyId(const uint16_t index) const;
   uint32_t GetIncludedStreamMask() const;
@@ -132,7 +143,8 @@ public:
   virtual void OnStreamChange(adaptive::AdaptiveStream *stream, uint32_t segment) override;
 
 protected:
-  void CheckFragmentDuration(STREAM &stream);
+  bool StartNextPeriod(STREAM &stream);
+  void ScheduleStream(unsigned int pos);
   void GetSupportedDecrypterURN(std::string &key_system);
   void DisposeDecrypter();
 
@@ -159,12 +171,24 @@ private:
   adaptive::AdaptiveTree *adaptiveTree_;
 
   std::vector<STREAM*> streams_;
+  // Min-heap of (DTS, index into streams_) of all readers with a sample ready
+  std::vector<std::pair<uint64_t, unsigned int> > schedule_;
+  bool schedule_valid_;
+
+  struct CACHEDMOVIE
+  {
+    AP4_ByteStream *init_;
+    AP4_Movie *movie_;
+  };
+  // Parsed init segments by init key (see AdaptiveStream::getInitKey)
+  std::map<std::string, CACHEDMOVIE> movie_cache_;
 
   uint16_t width_, height_;
   int max_resolution_, max_secure_resolution_;
   uint32_t fixed_bandwidth_;
   bool changed_;
   bool manual_streams_;
+  bool demux_thread_;
   uint64_t elapsed_time_;
   uint8_t media_type_mask_;
 };
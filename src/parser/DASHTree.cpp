@@ -17,10 +17,12 @@
 */
 
 #include <string>
+#include <algorithm>
 #include <cstring>
 #include <time.h>
 #include <float.h>
 #include <thread>
+#include <sstream>
 
 #include "DASHTree.h"
 #include "../oscompat.h"
@@ -231,6 +233,7 @@ static const char* ltranslate(const char * in)
 }
 
 DASHTree::DASHTree()
+  : is_update_(false)
 {
 }
 
@@ -276,6 +279,12 @@ static unsigned int ParseSegmentTemplate(const char **attr, std::string baseURL,
       startNumber = atoi((const char*)*(attr + 1));
     else if (strcmp((const char*)*attr, "initialization") == 0)
       tpl.initialization = (const char*)*(attr + 1);
+    else if (strcmp((const char*)*attr, "availabilityTimeOffset") == 0)
+      tpl.availabilityTimeOffset = atof((const char*)*(attr + 1));
+    else if (strcmp((const char*)*attr, "availabilityTimeComplete") == 0)
+      tpl.availabilityTimeComplete = strcmp((const char*)*(attr + 1), "false") != 0;
+    else if (strcmp((const char*)*attr, "presentationTimeOffset") == 0)
+      tpl.presentationTimeOffset = atoll((const char*)*(attr + 1));
     attr += 2;
   }
 
@@ -304,6 +313,23 @@ static time_t getTime(const char* timeStr)
   return ~0;
 }
 
+static uint64_t getTimeMs(const char* timeStr)
+{
+  time_t t(getTime(timeStr));
+  if (!~t)
+    return 0;
+
+  uint64_t ms(static_cast<uint64_t>(t) * 1000);
+  const char *frac(strchr(timeStr, '.'));
+  if (frac)
+  {
+    uint64_t scale(100);
+    for (++frac; *frac >= '0' && *frac <= '9' && scale; ++frac, scale /= 10)
+      ms += (*frac - '0') * scale;
+  }
+  return ms;
+}
+
 bool ParseContentProtection(const char **attr, DASHTree *dash)
 {
   dash->strXMLText_.clear();
@@ -351,6 +377,28 @@ bool ParseContentProtection(const char **attr, DASHTree *dash)
 |   expat start
 +---------------------------------------------------------------------*/
 
+static uint64_t getDurationMs(const char* durStr)
+{
+  double seconds(0);
+  if (durStr && *durStr++ == 'P' && *durStr++ == 'T')
+  {
+    const char *next = strchr(durStr, 'H');
+    if (next){
+      seconds += atof(durStr)*3600;
+      durStr = next + 1;
+    }
+    next = strchr(durStr, 'M');
+    if (next){
+      seconds += atof(durStr)*60;
+      durStr = next + 1;
+    }
+    next = strchr(durStr, 'S');
+    if (next)
+      seconds += atof(durStr);
+  }
+  return static_cast<uint64_t>(seconds * 1000);
+}
+
 static void ReplacePlaceHolders(std::string &rep, const std::string &id, uint32_t bandwidth)
 {
   std::string::size_type repPos = rep.find("$RepresentationID$");
@@ -927,10 +975,44 @@ start(void *data, const char *el, const char **attr)
     {
       dash->current_period_ = new DASHTree::Period();
       dash->current_period_->base_url_ = dash->base_url_;
+      bool hasStart(false);
+      for (; *attr;)
+      {
+        if (strcmp((const char*)*attr, "start") == 0)
+        {
+          dash->current_period_->start_ = getDurationMs((const char*)*(attr + 1));
+          hasStart = true;
+        }
+        else if (strcmp((const char*)*attr, "duration") == 0)
+          dash->current_period_->length_ = getDurationMs((const char*)*(attr + 1));
+        attr += 2;
+      }
+      // Without start a period follows its predecessor
+      if (!hasStart && !dash->periods_.empty())
+        dash->current_period_->start_ = dash->periods_.back()->start_ + dash->periods_.back()->length_;
       dash->periods_.push_back(dash->current_period_);
       dash->period_timelined_ = false;
       dash->currentNode_ |= DASHTree::MPDNODE_PERIOD;
     }
+    else if (strcmp(el, "UTCTiming") == 0 && dash->utc_timing_value_.empty())
+    {
+      const char *scheme(0), *value(0);
+      for (; *attr;)
+      {
+        if (strcmp((const char*)*attr, "schemeIdUri") == 0)
+          scheme = (const char*)*(attr + 1);
+        else if (strcmp((const char*)*attr, "value") == 0)
+          value = (const char*)*(attr + 1);
+        attr += 2;
+      }
+      if (scheme && value && (strcmp(scheme, "urn:mpeg:dash:utc:http-iso:2014") == 0
+        || strcmp(scheme, "urn:mpeg:dash:utc:http-xsdate:2014") == 0
+        || strcmp(scheme, "urn:mpeg:dash:utc:direct:2014") == 0))
+      {
+        dash->utc_timing_scheme_ = scheme;
+        dash->utc_timing_value_ = value;
+      }
+    }
   }
   else if (strcmp(el, "MPD") == 0)
   {
@@ -967,27 +1049,16 @@ start(void *data, const char *el, const char **attr)
     if (!~dash->available_time_)
       dash->available_time_ = dash->publish_time_;
 
+    dash->is_static_ = bStatic;
+
     if (!mpt)
       mpt = tsbd;
     else if (bStatic)
       dash->has_timeshift_buffer_ = false;
 
-    if (mpt && *mpt++ == 'P' && *mpt++ == 'T')
-    {
-      const char *next = strchr(mpt, 'H');
-      if (next){
-        dash->overallSeconds_ += static_cast<uint64_t>(atof(mpt)*3600);
-        mpt = next + 1;
-      }
-      next = strchr(mpt, 'M');
-      if (next){
-        dash->overallSeconds_ += static_cast<uint64_t>(atof(mpt)*60);
-        mpt = next + 1;
-      }
-      next = strchr(mpt, 'S');
-      if (next)
-        dash->overallSeconds_ += static_cast<uint64_t>(atof(mpt));
-    }
+    dash->overallSeconds_ = getDurationMs(mpt) / 1000;
+    if (dash->has_timeshift_buffer_)
+      dash->timeshift_buffer_depth_ = static_cast<uint32_t>(getDurationMs(tsbd) / 1000);
     if (dash->publish_time_ && dash->available_time_ && dash->publish_time_ - dash->available_time_ > dash->overallSeconds_)
       dash->base_time_ = dash->publish_time_ - dash->available_time_ - dash->overallSeconds_;
     dash->minPresentationOffset = ~0ULL;
@@ -1100,6 +1171,11 @@ end(void *data, const char *el)
               }
             }
 
+            // Low latency: segments are requested while being produced and arrive in CMAF chunks
+            if (!(dash->current_representation_->segtpl_.media.empty() ? dash->current_adaptationset_->segtpl_
+              : dash->current_representation_->segtpl_).availabilityTimeComplete && dash->has_timeshift_buffer_)
+              dash->current_representation_->flags_ |= DASHTree::Representation::CHUNKEDSEGMENTS;
+
             if (dash->current_representation_->segments_.data.empty())
             {
               bool isSegmentTpl(!dash->current_representation_->segtpl_.media.empty());
@@ -1126,6 +1202,9 @@ end(void *data, const char *el)
                       dash->current_representation_->url_ += tpl.initialization;
                       ReplacePlaceHolders(dash->current_representation_->url_, dash->current_representation_->id, dash->current_representation_->bandwidth_);
                       dash->current_representation_->segtpl_.media = tpl.media;
+                      dash->current_representation_->segtpl_.availabilityTimeOffset = tpl.availabilityTimeOffset;
+                      dash->current_representation_->segtpl_.presentationTimeOffset = tpl.presentationTimeOffset;
+                      dash->current_representation_->segtpl_.timescale = tpl.timescale;
                       ReplacePlaceHolders(dash->current_representation_->segtpl_.media, dash->current_representation_->id, dash->current_representation_->bandwidth_);
                     }
 
@@ -1133,7 +1212,7 @@ end(void *data, const char *el)
                     dash->current_representation_->flags_ |= DASHTree::Representation::INITIALIZATION;
                   }
 
-                  std::vector<uint32_t>::const_iterator sdb(dash->current_adaptationset_->segment_durations_.data.begin()),
+                  STABLEVECTOR<uint32_t>::const_iterator sdb(dash->current_adaptationset_->segment_durations_.data.begin()),
                     sde(dash->current_adaptationset_->segment_durations_.data.end());
                   bool timeBased = sdb!=sde && tpl.media.find("$Time") != std::string::npos;
                   if (dash->adp_timelined_)
@@ -1162,7 +1241,7 @@ end(void *data, const char *el)
                 //Let us try to extract the fragments out of SIDX atom  
                 dash->current_representation_->flags_ |= DASHTree::Representation::SEGMENTBASE;
                 dash->current_representation_->indexRangeMin_ = 0;
-                dash->current_representation_->indexRangeMax_ = 1024 * 200;
+                dash->current_representation_->indexRangeMax_ = ~0U; //extent gets probed from the box headers
               }
             }
             else
@@ -1273,10 +1352,10 @@ end(void *data, const char *el)
               {
                 if ((*b)->flags_ & DASHTree::Representation::TIMELINE)
                   continue;
-                std::vector<uint32_t>::const_iterator sdb(dash->current_adaptationset_->segment_durations_.data.begin()),
+                STABLEVECTOR<uint32_t>::const_iterator sdb(dash->current_adaptationset_->segment_durations_.data.begin()),
                   sde(dash->current_adaptationset_->segment_durations_.data.end());
                 uint64_t spts(0);
-                for (std::vector<DASHTree::Segment>::iterator sb((*b)->segments_.data.begin()), se((*b)->segments_.data.end()); sb != se && sdb != sde; ++sb, ++sdb)
+                for (STABLEVECTOR<DASHTree::Segment>::iterator sb((*b)->segments_.data.begin()), se((*b)->segments_.data.end()); sb != se && sdb != sde; ++sb, ++sdb)
                 {
                   sb->startPTS_ = spts;
                   spts += *sdb;
@@ -1357,20 +1436,105 @@ bool DASHTree::open(const std::string &url, const std::string &manifestUpdatePar
   currentNode_ = 0;
   strXMLText_.clear();
 
-  bool ret = download(manifest_url_.c_str(), manifest_headers_);
+  // Updates of an unchanged manifest are answered with 304, leaving this tree empty.
+  // On first open a 304 confirms the snapshot of a previous session.
+  std::string snapshot;
+  bool useSnapshot(!is_update_ && ReadSnapshot(snapshot));
+  bool notModified(false);
+  bool ret = download(manifest_url_.c_str(), manifest_headers_, nullptr, (is_update_ || !snapshot_path_.empty()) ? &notModified : nullptr);
 
   XML_ParserFree(parser_);
   parser_ = 0;
 
-  SortTree();
+  if (ret && useSnapshot && notModified)
+  {
+    // Invalid snapshots are removed, parse the manifest again
+    if (!LoadSnapshot(snapshot))
+    {
+      refresh_state_.validators_.erase(manifest_url_);
+      return open(url, manifestUpdateParam);
+    }
+  }
+  else
+  {
+    SortTree();
+    if (ret && !is_update_)
+      SaveSnapshot();
+  }
+
+  // Playback starts with the first period, following ones are entered by the streams
+  current_period_ = periods_.empty() ? nullptr : periods_[0];
 
   last_update_time_ = std::chrono::steady_clock::now();
 
+  if (ret && !is_update_ && has_timeshift_buffer_ && !utc_timing_value_.empty())
+    SyncClock();
+
   return ret;
 }
 
-bool DASHTree::write_data(void *buffer, size_t buffer_size)
+void DASHTree::SyncClock()
+{
+  uint64_t localBefore(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+  uint64_t originTime(0);
+
+  if (utc_timing_scheme_ == "urn:mpeg:dash:utc:direct:2014")
+    originTime = getTimeMs(utc_timing_value_.c_str());
+  else
+  {
+    std::stringstream timeStream;
+    if (download(utc_timing_value_.c_str(), manifest_headers_, &timeStream))
+      originTime = getTimeMs(timeStream.str().c_str());
+  }
+
+  if (!originTime)
+  {
+    Log(LOGLEVEL_ERROR, "UTCTiming: unable to get origin time from %s", utc_timing_value_.c_str());
+    return;
+  }
+
+  // Assume the origin answered in the middle of our request
+  uint64_t localAfter(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+  clock_offset_ = static_cast<int64_t>(originTime) - static_cast<int64_t>((localBefore + localAfter) / 2);
+  Log(LOGLEVEL_DEBUG, "UTCTiming: origin clock offset %" PRId64 " ms", clock_offset_);
+}
+
+uint64_t DASHTree::GetSegmentAvailableTime(const Representation *rep, const Segment *seg) const
+{
+  if (!has_timeshift_buffer_ || !available_time_ || !~available_time_ || !current_period_
+    || (rep->flags_ & Representation::SEGMENTBASE) || !seg || seg == &rep->initialization_)
+    return 0;
+
+  // Segment lists only have timing from an adaptation set SegmentTimeline, relative to the period start
+  const bool isTemplate((rep->flags_ & Representation::TEMPLATE) != 0);
+  if (!isTemplate && !rep->nextPts_)
+    return 0;
+
+  uint32_t timescale(isTemplate && rep->segtpl_.timescale ? rep->segtpl_.timescale : rep->timescale_);
+  if (!timescale)
+    return 0;
+
+  // A segment is available once it is completely produced, availabilityTimeOffset earlier
+  const Segment *next(rep->get_segment(rep->get_segment_pos(seg) + 1));
+  uint64_t endPTS(next ? next->startPTS_ : rep->nextPts_);
+  if (isTemplate)
+    endPTS += base_time_ * timescale;
+  if (isTemplate && (rep->flags_ & Representation::TIMELINE))
+    endPTS = endPTS > rep->segtpl_.presentationTimeOffset ? endPTS - rep->segtpl_.presentationTimeOffset : 0;
+
+  int64_t availableTime(static_cast<int64_t>(available_time_ * 1000 + current_period_->start_ + (endPTS * 1000) / timescale)
+    - static_cast<int64_t>((isTemplate ? rep->segtpl_.availabilityTimeOffset : 0.0) * 1000) - clock_offset_);
+  return availableTime > 0 ? static_cast<uint64_t>(availableTime) : 0;
+}
+
+bool DASHTree::write_data(void *buffer, size_t buffer_size, void *opaque)
 {
+  if (opaque)
+  {
+    static_cast<std::stringstream*>(opaque)->write(static_cast<const char*>(buffer), buffer_size);
+    return true;
+  }
+
   bool done(false);
   XML_Status retval = XML_Parse(parser_, (const char*)buffer, buffer_size, done);
 
@@ -1385,7 +1549,7 @@ bool DASHTree::write_data(void *buffer, size_t buffer_size)
 void DASHTree::RefreshSegments(Representation *rep, const Segment *seg)
 {
   unsigned int freeSegments = rep->get_segment_pos(seg);
-  if (freeSegments && has_timeshift_buffer_ && !update_parameter_.empty())
+  if ((freeSegments || timeshift_buffer_depth_) && has_timeshift_buffer_ && !update_parameter_.empty())
   {
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
     if (std::chrono::duration_cast<std::chrono::seconds>(now - last_update_time_).count() > 1)
@@ -1401,9 +1565,15 @@ void DASHTree::RefreshSegments(Representation *rep, const Segment *seg)
 
     NEXTLIVETRY:
       DASHTree updateTree;
+      updateTree.is_update_ = true;
       bool someInserted(false);
-      if (updateTree.open(manifest_url_ + replaced, ""))
+      // Let the update use and maintain our validators for conditional requests
+      std::swap(updateTree.refresh_state_, refresh_state_);
+      bool updated(updateTree.open(manifest_url_ + replaced, ""));
+      std::swap(updateTree.refresh_state_, refresh_state_);
+      if (updated)
       {
+        std::unique_lock<std::mutex> lck(m_segmentMutex);
         std::vector<Period*>::const_iterator bpd(periods_.begin()), epd(periods_.end());
         for (std::vector<Period*>::const_iterator bp(updateTree.periods_.begin()), ep(updateTree.periods_.end()); bp != ep && bpd != epd; ++bp, ++bpd)
         {
@@ -1414,6 +1584,13 @@ void DASHTree::RefreshSegments(Representation *rep, const Segment *seg)
             for (; bad != ead && (*bad)->id != (*ba)->id; ++bad);
             if (bad != ead)
             {
+              // Only the stream asking for the refresh tells how far it has played, other
+              // adaptation sets may only expire segments while none of their streams plays
+              const std::vector<Representation*> &reps((*bad)->repesentations_);
+              bool ownSet(std::find(reps.begin(), reps.end(), rep) != reps.end()), playing(false);
+              for (std::vector<Representation*>::const_iterator b(reps.begin()), e(reps.end()); b != e && !playing; ++b)
+                playing = ((*b)->flags_ & Representation::ENABLED) != 0;
+
               for (std::vector<Representation*>::iterator br((*ba)->repesentations_.begin()), er((*ba)->repesentations_.end()); br != er; ++br)
               {
                 //Youtube returns last smallest number in case the requested data is not available
@@ -1428,29 +1605,35 @@ void DASHTree::RefreshSegments(Representation *rep, const Segment *seg)
                   //Here we go -> Insert new segments
                   uint64_t ptsOffset = (*brd)->nextPts_ - (*br)->segments_[0]->startPTS_;
                   unsigned int repFreeSegments(freeSegments);
-                  std::vector<Segment>::iterator bs((*br)->segments_.data.begin()), es((*br)->segments_.data.end());
-                  for (; bs != es && repFreeSegments; ++bs)
+                  size_t appended(0);
+                  STABLEVECTOR<Segment>::iterator bs((*br)->segments_.data.begin()), es((*br)->segments_.data.end());
+                  for (; bs != es && (timeshift_buffer_depth_ || repFreeSegments); ++bs)
                   {
                     Log(LOGLEVEL_DEBUG, "DASH Update: insert repid: %s url: %s", (*br)->id.c_str(), bs->url);
-                    if ((*brd)->flags_ & Representation::URLSEGMENTS)
-                      delete[](*brd)->segments_[0]->url;
                     bs->startPTS_ += ptsOffset;
-                    (*brd)->segments_.insert(*bs);
+                    (*brd)->segments_.append(*bs);
                     if ((*brd)->flags_ & Representation::URLSEGMENTS)
                       bs->url = nullptr;
-                    ++(*brd)->startNumber_;
-                    --repFreeSegments;
+                    if (repFreeSegments)
+                      --repFreeSegments;
+                    ++appended;
                     someInserted = true;
                   }
                   if (bs == es)
                     (*brd)->nextPts_ += (*br)->nextPts_;
                   else
                     (*brd)->nextPts_ += bs->startPTS_;
+                  // The window grows up to timeShiftBufferDepth, segments in front of the played one may expire
+                  if (ownSet)
+                    TrimSegments(*brd, GetExpiredSegments(*brd, freeSegments, appended));
+                  else if (!playing)
+                    TrimSegments(*brd, GetExpiredSegments(*brd, (*brd)->segments_.size(), appended));
                 }
               }
             }
           }
         }
+        lck.unlock();
         if (!someInserted && retryCount-- && freeSegments + 1 >= rep->segments_.size())
         {
           for (unsigned int i(0); i < 20; ++i)
@@ -29,8 +29,9 @@ namespace adaptive
   public:
     DASHTree();
     virtual bool open(const std::string &url, const std::string &manifestUpdateParam) override;
-    virtual bool write_data(void *buffer, size_t buffer_size) override;
+    virtual bool write_data(void *buffer, size_t buffer_size, void *opaque) override;
     virtual void RefreshSegments(Representation *rep, const Segment *seg) override;
+    virtual uint64_t GetSegmentAvailableTime(const Representation *rep, const Segment *seg) const override;
 
     enum
     {
@@ -51,5 +52,10 @@ namespace adaptive
     };
     uint64_t pts_helper_;
     std::chrono::steady_clock::time_point last_update_time_;
+    std::string utc_timing_scheme_, utc_timing_value_;
+    bool is_update_; //manifest update of a live tree, uses its clock offset and validators
+
+  private:
+    void SyncClock();
   };
 }
@@ -17,6 +17,7 @@
 */
 
 #include "HLSTree.h"
+#include <algorithm>
 #include <map>
 #include <string.h>
 #include <thread>
@@ -54,6 +55,15 @@ static void parseResolution(std::uint16_t &width, std::uint16_t &height, const s
   }
 }
 
+static std::string resolveUrl(const std::string &url, const std::string &baseDomain, const std::string &baseUrl)
+{
+  if (url[0] == '/')
+    return baseDomain + url;
+  else if (url.find("://", 0) == std::string::npos)
+    return baseUrl + url;
+  return url;
+}
+
 static std::string getVideoCodec(const std::string &codecs)
 {
   if (codecs.empty() || codecs.find("avc1.") != std::string::npos)
@@ -71,8 +81,32 @@ static std::string getAudioCodec(const std::string &codecs)
     return  "aac";
 }
 
+// Prefetched playlists of live streams are reloaded every n-th target duration
+static const unsigned int PREFETCH_REFRESH_FACTOR = 3;
+static const size_t MAX_CACHED_KEYS = 32;
+// Lower bound for the poll interval while waiting for partial segments
+static const unsigned int MIN_PART_RELOAD_MS = 100;
+
 HLSTree::~HLSTree()
 {
+  if (m_prefetchThread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lck(m_treeMutex);
+      m_prefetchStop = true;
+    }
+    m_prefetchSignal.notify_one();
+    m_prefetchThread.join();
+  }
+  if (m_keyThread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lck(m_keyMutex);
+      m_keyStop = true;
+    }
+    m_keySignal.notify_one();
+    m_keyThread.join();
+  }
   delete m_decrypter;
 }
 
@@ -82,6 +116,17 @@ void HLSTree::ClearStream()
   m_stream.clear();
 }
 
+void HLSTree::FreeSegments(Representation *rep, SPINCACHE<Segment> &segments)
+{
+  if (rep->flags_ & Representation::URLSEGMENTS)
+    for (auto &s : segments.data)
+    {
+      --psshSets_[s.pssh_set_].use_count_;
+      delete[] s.url;
+    }
+  segments.clear();
+}
+
 bool HLSTree::open(const std::string &url, const std::string &manifestUpdateParam)
 {
   PreparePaths(url, manifestUpdateParam);
@@ -249,6 +294,9 @@ bool HLSTree::open(const std::string &url, const std::string &manifestUpdatePara
     }
     // Set Live as default
     has_timeshift_buffer_ = true;
+
+    if (m_prefetchPlaylists)
+      m_prefetchThread = std::thread(&HLSTree::PrefetchWorker, this);
     return true;
   }
   return false;
@@ -256,24 +304,109 @@ bool HLSTree::open(const std::string &url, const std::string &manifestUpdatePara
 
 bool HLSTree::prepareRepresentation(Representation *rep, bool update)
 {
-  if (!rep->source_url_.empty())
+  std::unique_lock<std::mutex> lck(m_treeMutex);
+
+  // Take over a playlist the prefetch thread has loaded into newSegments_
+  if (!update && m_prefetched.erase(rep) && ~rep->newStartNumber_)
   {
-    ClearStream();
+    FreeSegments(rep, rep->segments_);
+    rep->segments_.swap(rep->newSegments_);
+    rep->startNumber_ = rep->newStartNumber_;
+    rep->newStartNumber_ = ~0U;
+
+    // A live playlist may have moved on since it was prefetched, bring it up to date before
+    // the start position gets chosen. Conditional and delta reloads keep this cheaper than a full load
+    if (m_refreshPlayList && LoadPlaylist(rep, true, lck) && ~rep->newStartNumber_)
+    {
+      FreeSegments(rep, rep->segments_);
+      rep->segments_.swap(rep->newSegments_);
+      rep->startNumber_ = rep->newStartNumber_;
+      rep->newStartNumber_ = ~0U;
+    }
+    return true;
+  }
+  return LoadPlaylist(rep, update, lck);
+}
 
+bool HLSTree::LoadPlaylist(Representation *rep, bool update, std::unique_lock<std::mutex> &lck, unsigned int blockingMsn, unsigned int blockingPart, std::stringstream *prefetched)
+{
+  if (!rep->source_url_.empty())
+  {
+    // A prefetched playlist is not played yet, it must not change the timing of the tree
+    const bool active(!prefetched);
+    PLAYLISTSTATE &state(m_playlistStates[rep]);
     SPINCACHE<Segment> &segments(update ? rep->newSegments_ : rep->segments_);
-    if (rep->flags_ & Representation::URLSEGMENTS)
-      for (auto &s : segments.data)
+
+    // Keep a not yet consumed update until we know the reload brought something new
+    SPINCACHE<Segment> pending;
+    if (update && ~rep->newStartNumber_)
+      pending.swap(rep->newSegments_);
+
+    // Delta updates need a complete playlist not older than half the skip boundary
+    const SPINCACHE<Segment> *deltaBase(nullptr);
+    unsigned int deltaBaseNumber(0);
+    if (active && update && state.m_canSkipUntil > 0.0
+      && std::chrono::steady_clock::now() - state.m_loaded < std::chrono::duration<double>(state.m_canSkipUntil / 2))
+    {
+      if (!pending.empty())
+      {
+        deltaBase = &pending;
+        deltaBaseNumber = rep->newStartNumber_;
+      }
+      else if (!rep->segments_.empty())
       {
-        --psshSets_[s.pssh_set_].use_count_;
-        delete[] s.url;
+        deltaBase = &rep->segments_;
+        deltaBaseNumber = rep->startNumber_;
       }
-    segments.clear();
+    }
+    FreeSegments(rep, segments);
+
+    // Delivery directives, in the order the server expects them
+    std::string url(rep->source_url_), directives;
+    if (~blockingMsn && state.m_canBlockReload)
+    {
+      char buf[48];
+      if (~blockingPart)
+        sprintf(buf, "&_HLS_msn=%u&_HLS_part=%u", blockingMsn, blockingPart);
+      else
+        sprintf(buf, "&_HLS_msn=%u", blockingMsn);
+      directives = buf;
+    }
+    if (deltaBase)
+      directives += "&_HLS_skip=YES";
+    if (!directives.empty())
+    {
+      directives[0] = url.find('?') == std::string::npos ? '?' : '&';
+      url += directives;
+    }
+
+    // A blocking reload is held back by the server until the segment exists, don't block others meanwhile
+    std::stringstream downloadedPlaylist;
+    std::stringstream &playlist(prefetched ? *prefetched : downloadedPlaylist);
+    bool downloaded, notModified(false);
+    if (prefetched)
+      downloaded = true;
+    else if (~blockingMsn && state.m_canBlockReload)
+    {
+      lck.unlock();
+      downloaded = download(url.c_str(), manifest_headers_, &playlist);
+      lck.lock();
+    }
+    else
+      downloaded = download(url.c_str(), manifest_headers_, &playlist, update ? &notModified : nullptr);
 
-    if (download(rep->source_url_.c_str(), manifest_headers_))
+    if (downloaded && notModified)
+    {
+      // Nothing changed since our last reload, keep what we have
+      pending.swap(rep->newSegments_);
+      return true;
+    }
+
+    if (downloaded)
     {
 #if FILEDEBUG
       FILE *f = fopen("inputstream_adaptive_sub.m3u8", "w");
-      fwrite(m_stream.str().data(), 1, m_stream.str().size(), f);
+      fwrite(playlist.str().data(), 1, playlist.str().size(), f);
       fclose(f);
 #endif
       bool byteRange(false);
@@ -290,12 +423,21 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
       segment.range_end_ = 0;
       segment.startPTS_ = ~0ULL;
       segment.pssh_set_ = 0;
+      state.m_canSkipUntil = 0.0;
+      state.m_canBlockReload = false;
+      state.m_partTarget = 0.0;
+      state.m_parts.clear();
+      bool deltaFailed(false);
+      // Parts of the segment following the last complete one
+      std::vector<std::string> parts;
+      uint64_t partsDuration(0);
+      bool partsByteRange(false);
 
       std::string::size_type bs = rep->source_url_.rfind('/');
       if (bs != std::string::npos)
         base_url = rep->source_url_.substr(0, bs + 1);
 
-      while (std::getline(m_stream, line))
+      while (std::getline(playlist, line))
       {
         if (!startCodeFound)
         {
@@ -365,6 +507,14 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
           }
           segments.data.push_back(segment);
           segment.startPTS_ = ~0ULL;
+
+          if (!parts.empty())
+          {
+            unsigned int msn((update ? rep->newStartNumber_ : rep->startNumber_) + static_cast<unsigned int>(segments.data.size() - 1));
+            state.m_parts[msn].swap(parts);
+            parts.clear();
+          }
+          partsDuration = 0;
         }
         else if (line.compare(0, 22, "#EXT-X-MEDIA-SEQUENCE:") == 0)
         {
@@ -375,14 +525,19 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
         }
         else if (line.compare(0, 21, "#EXT-X-PLAYLIST-TYPE:") == 0)
         {
-          if (strcmp(line.c_str() + 21, "VOD") == 0)
+          if (active && strcmp(line.c_str() + 21, "VOD") == 0)
           {
             m_refreshPlayList = false;
             has_timeshift_buffer_ = false;
           }
         }
         else if (line.compare(0, 22, "#EXT-X-TARGETDURATION:") == 0)
-          m_segmentIntervalSec = atoi(line.c_str() + 22);
+        {
+          // Keep the previous (or default) interval if the value is unusable, reload timing relies on it
+          int targetDuration(atoi(line.c_str() + 22));
+          if (active && targetDuration > 0)
+            m_segmentIntervalSec = targetDuration;
+        }
         else if (line.compare(0, 11, "#EXT-X-KEY:") == 0)
         {
           if (!rep->pssh_set_)
@@ -405,6 +560,7 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
                 current_pssh_ = base_domain_ + current_pssh_;
               else if (current_pssh_.find("://", 0) == std::string::npos)
                 current_pssh_ = base_url + current_pssh_;
+              RequestKey(current_pssh_);
 
               current_iv_ = m_decrypter->convertIV(map["IV"]);
               segment.pssh_set_ = insert_psshset(NOTYPE);
@@ -413,12 +569,103 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
         }
         else if (line.compare(0, 14, "#EXT-X-ENDLIST") == 0)
         {
-          m_refreshPlayList = false;
-          has_timeshift_buffer_ = false;
+          if (active)
+          {
+            m_refreshPlayList = false;
+            has_timeshift_buffer_ = false;
+          }
+        }
+        else if (line.compare(0, 22, "#EXT-X-SERVER-CONTROL:") == 0)
+        {
+          parseLine(line, 22, map);
+          if (map.find("CAN-SKIP-UNTIL") != map.end())
+            state.m_canSkipUntil = atof(map["CAN-SKIP-UNTIL"].c_str());
+          state.m_canBlockReload = map["CAN-BLOCK-RELOAD"] == "YES";
+        }
+        else if (line.compare(0, 16, "#EXT-X-PART-INF:") == 0)
+        {
+          parseLine(line, 16, map);
+          state.m_partTarget = atof(map["PART-TARGET"].c_str());
+        }
+        else if (line.compare(0, 12, "#EXT-X-PART:") == 0)
+        {
+          //#EXT-X-PART:DURATION=1.00000,INDEPENDENT=YES,URI="filePart271.0.ts"
+          parseLine(line, 12, map);
+          if (map.find("BYTERANGE") != map.end())
+            partsByteRange = true;
+          else if (!map["URI"].empty())
+          {
+            parts.push_back(resolveUrl(map["URI"], base_domain_, base_url));
+            partsDuration += static_cast<uint64_t>(atof(map["DURATION"].c_str()) * rep->timescale_);
+          }
+        }
+        else if (line.compare(0, 20, "#EXT-X-PRELOAD-HINT:") == 0)
+        {
+          // The hinted part is requested right away, the server answers when it's ready
+          parseLine(line, 20, map);
+          if (map["TYPE"] == "PART" && map.find("BYTERANGE-START") == map.end() && !map["URI"].empty())
+            parts.push_back(resolveUrl(map["URI"], base_domain_, base_url));
+        }
+        else if (line.compare(0, 12, "#EXT-X-SKIP:") == 0)
+        {
+          //#EXT-X-SKIP:SKIPPED-SEGMENTS=n replaces the first n segments, take them from our last playlist
+          parseLine(line, 12, map);
+          unsigned int skipped(atoi(map["SKIPPED-SEGMENTS"].c_str()));
+          unsigned int first(update ? rep->newStartNumber_ : rep->startNumber_);
+          if (!deltaBase || !segments.data.empty() || first < deltaBaseNumber
+            || first - deltaBaseNumber + skipped >= deltaBase->data.size())
+          {
+            deltaFailed = true;
+            break;
+          }
+          for (unsigned int i(first - deltaBaseNumber), e(i + skipped); i < e; ++i)
+          {
+            Segment copy(*(*deltaBase)[i]);
+            copy.startPTS_ = pts;
+            pts += (*deltaBase)[i + 1]->startPTS_ - (*deltaBase)[i]->startPTS_;
+            if (rep->flags_ & Representation::URLSEGMENTS)
+            {
+              size_t len(strlen(copy.url) + 1);
+              copy.url = static_cast<const char*>(memcpy(new char[len], copy.url, len));
+              ++psshSets_[copy.pssh_set_].use_count_;
+            }
+            segments.data.push_back(copy);
+            segment.pssh_set_ = copy.pssh_set_;
+          }
         }
       }
 
-      overallSeconds_ = segments[0] ? (pts - segments[0]->startPTS_) / rep->timescale_ : 0;
+      if (deltaFailed && !active)
+      {
+        FreeSegments(rep, segments);
+        FreeSegments(rep, pending);
+        return false;
+      }
+      if (deltaFailed)
+      {
+        Log(LOGLEVEL_DEBUG, "Playlist delta update does not fit to the last playlist, reloading it completely");
+        FreeSegments(rep, segments);
+        FreeSegments(rep, pending);
+        state.m_loaded = std::chrono::steady_clock::time_point();
+        return LoadPlaylist(rep, update, lck, blockingMsn, blockingPart);
+      }
+      state.m_loaded = std::chrono::steady_clock::now();
+
+      // Append the segment in production, it will be fetched part by part
+      state.m_incompleteMsn = ~0U;
+      if (!parts.empty() && !byteRange && !partsByteRange && m_refreshPlayList)
+      {
+        segment.startPTS_ = pts;
+        segment.url = static_cast<const char*>(memcpy(new char[parts[0].size() + 1], parts[0].c_str(), parts[0].size() + 1));
+        segments.data.push_back(segment);
+        pts += partsDuration;
+
+        state.m_incompleteMsn = (update ? rep->newStartNumber_ : rep->startNumber_) + static_cast<unsigned int>(segments.data.size() - 1);
+        state.m_parts[state.m_incompleteMsn].swap(parts);
+      }
+
+      if (active)
+        overallSeconds_ = segments[0] ? (pts - segments[0]->startPTS_) / rep->timescale_ : 0;
 
       if (!byteRange)
         rep->flags_ |= Representation::URLSEGMENTS;
@@ -432,9 +679,12 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
         rep->initialization_.pssh_set_ = 0;
       }
     }
+    FreeSegments(rep, pending);
+
     if (segments.data.empty())
     {
-      rep->source_url_.clear(); // disable this segment
+      if (!update)
+        rep->source_url_.clear(); // disable this segment
       return false;
     }
     return true;
@@ -442,9 +692,170 @@ bool HLSTree::prepareRepresentation(Representation *rep, bool update)
   return false;
 };
 
-bool HLSTree::write_data(void *buffer, size_t buffer_size)
+void HLSTree::PrefetchWorker()
 {
-  m_stream.write(static_cast<const char*>(buffer), buffer_size);
+  std::unique_lock<std::mutex> lck(m_treeMutex);
+
+  while (!m_prefetchStop)
+  {
+    // Collect the neighbours of the active video variant and all audio renditions
+    std::vector<Representation*> candidates;
+    for (auto adp : current_period_->adaptationSets_)
+    {
+      std::vector<Representation*> &reps(adp->repesentations_);
+      if (adp->type_ == AUDIO)
+        candidates.insert(candidates.end(), reps.begin(), reps.end());
+      else if (adp->type_ == VIDEO)
+        for (size_t i(0); i < reps.size(); ++i)
+          if (reps[i]->flags_ & Representation::ENABLED)
+          {
+            if (i)
+              candidates.push_back(reps[i - 1]);
+            if (i + 1 < reps.size())
+              candidates.push_back(reps[i + 1]);
+          }
+    }
+
+    for (auto rep : candidates)
+    {
+      // Enabled representations are refreshed by their stream
+      if (rep->source_url_.empty() || (rep->flags_ & Representation::ENABLED))
+        continue;
+
+      std::map<const Representation*, std::chrono::steady_clock::time_point>::const_iterator warm(m_prefetched.find(rep));
+      if (warm != m_prefetched.end() && (!m_refreshPlayList
+        || std::chrono::steady_clock::now() - warm->second < std::chrono::seconds(PREFETCH_REFRESH_FACTOR * m_segmentIntervalSec)))
+        continue;
+
+      // Download without the lock, streams must not wait for our network I/O
+      std::string url(rep->source_url_);
+      std::stringstream playlist;
+      lck.unlock();
+      bool downloaded(download(url.c_str(), manifest_headers_, &playlist));
+      lck.lock();
+      if (m_prefetchStop)
+        return;
+
+      // The representation may have been enabled meanwhile, its stream owns it now
+      if (rep->flags_ & Representation::ENABLED || rep->source_url_ != url)
+        continue;
+
+      if (downloaded && LoadPlaylist(rep, true, lck, ~0U, ~0U, &playlist))
+        m_prefetched[rep] = std::chrono::steady_clock::now();
+      else
+      {
+        FreeSegments(rep, rep->newSegments_);
+        rep->newStartNumber_ = ~0U;
+        m_prefetched.erase(rep);
+      }
+    }
+    m_prefetchSignal.wait_for(lck, std::chrono::seconds(m_refreshPlayList ? m_segmentIntervalSec : 1));
+  }
+}
+
+void HLSTree::RequestKey(const std::string &uri)
+{
+  std::lock_guard<std::mutex> lck(m_keyMutex);
+
+  if (uri == m_keyLoading || std::find(m_keyQueue.begin(), m_keyQueue.end(), uri) != m_keyQueue.end())
+    return;
+  for (const auto &key : m_keys)
+    if (key.first == uri)
+      return;
+
+  m_keyQueue.push_back(uri);
+  if (!m_keyThread.joinable())
+    m_keyThread = std::thread(&HLSTree::KeyWorker, this);
+  m_keySignal.notify_one();
+}
+
+std::string HLSTree::GetKey(const std::string &uri)
+{
+  std::unique_lock<std::mutex> lck(m_keyMutex);
+
+  while (true)
+  {
+    for (std::list<std::pair<std::string, std::string> >::iterator key(m_keys.begin()); key != m_keys.end(); ++key)
+      if (key->first == uri)
+      {
+        m_keys.splice(m_keys.begin(), m_keys, key);
+        return key->second;
+      }
+    // Join a download in progress instead of fetching the key twice
+    if (uri != m_keyLoading)
+      break;
+    m_keyLoaded.wait(lck);
+  }
+
+  // Not fetched ahead (evicted, or the key thread failed): fetch it now
+  std::deque<std::string>::iterator queued(std::find(m_keyQueue.begin(), m_keyQueue.end(), uri));
+  if (queued != m_keyQueue.end())
+    m_keyQueue.erase(queued);
+  lck.unlock();
+
+  std::string key;
+  if (!DownloadKey(uri, key))
+    return std::string();
+
+  lck.lock();
+  StoreKey(uri, key);
+  return key;
+}
+
+bool HLSTree::DownloadKey(const std::string &uri, std::string &key)
+{
+  std::map<std::string, std::string> headers;
+  std::vector<std::string> keyParts(split(m_decrypter->getLicenseKey(), '|'));
+  if (keyParts.size() > 1)
+    parseheader(headers, keyParts[1].c_str());
+
+  std::stringstream stream;
+  if (!download(uri.c_str(), headers, &stream))
+  {
+    Log(LOGLEVEL_ERROR, "Unable to download AES key: %s", uri.c_str());
+    return false;
+  }
+  key = stream.str();
+  return true;
+}
+
+// m_keyMutex must be held
+void HLSTree::StoreKey(const std::string &uri, const std::string &key)
+{
+  m_keys.push_front(std::make_pair(uri, key));
+  if (m_keys.size() > MAX_CACHED_KEYS)
+    m_keys.pop_back();
+}
+
+void HLSTree::KeyWorker()
+{
+  std::unique_lock<std::mutex> lck(m_keyMutex);
+
+  while (!m_keyStop)
+  {
+    if (m_keyQueue.empty())
+    {
+      m_keySignal.wait(lck);
+      continue;
+    }
+    std::string uri(m_keyQueue.front()), key;
+    m_keyQueue.pop_front();
+    m_keyLoading = uri;
+
+    lck.unlock();
+    bool loaded(DownloadKey(uri, key));
+    lck.lock();
+
+    if (loaded)
+      StoreKey(uri, key);
+    m_keyLoading.clear();
+    m_keyLoaded.notify_all();
+  }
+}
+
+bool HLSTree::write_data(void *buffer, size_t buffer_size, void *opaque)
+{
+  (opaque ? *static_cast<std::stringstream*>(opaque) : m_stream).write(static_cast<const char*>(buffer), buffer_size);
   return true;
 }
 
@@ -456,17 +867,10 @@ void HLSTree::OnDataArrived(Representation *rep, const Segment *seg, const uint8
     //Encrypted media, decrypt it
     if (pssh.defaultKID_.empty())
     {
-      ClearStream();
-      std::map<std::string, std::string> headers;
-      std::vector<std::string> keyParts(split(m_decrypter->getLicenseKey(), '|'));
-      if (keyParts.size() > 1)
-        parseheader(headers, keyParts[1].c_str());
-      if (download(pssh.pssh_.c_str(), headers))
-      {
-        pssh.defaultKID_ = m_stream.str();
-      }
-      else
-        pssh.defaultKID_ = "0000000000000000";
+      std::string key(GetKey(pssh.pssh_));
+      std::lock_guard<std::mutex> lck(m_keyMutex);
+      if (pssh.defaultKID_.empty())
+        pssh.defaultKID_ = key.empty() ? "0000000000000000" : key;
     }
     if (!dstOffset)
     {
@@ -483,29 +887,107 @@ void HLSTree::OnDataArrived(Representation *rep, const Segment *seg, const uint8
     AdaptiveTree::OnDataArrived(rep, seg, src, dst, dstOffset, dataSize);
 }
 
+void HLSTree::SetRepresentationEnabled(Representation *rep, bool enabled)
+{
+  std::lock_guard<std::mutex> lck(m_treeMutex);
+  AdaptiveTree::SetRepresentationEnabled(rep, enabled);
+}
+
 void HLSTree::RefreshSegments(Representation *rep, const Segment *seg)
 {
   if (m_refreshPlayList)
   {
-    int retryCount((m_segmentIntervalSec+3) &~3);
+    std::unique_lock<std::mutex> lck(m_treeMutex);
+
+    if (rep->segments_.pos(seg) + 1 != rep->segments_.size())
+    {
+      LoadPlaylist(rep, true, lck);
+      return;
+    }
+
+    // We are at the live edge, wait for the next segment to appear
+    unsigned int nextSegment(rep->startNumber_ + static_cast<unsigned int>(rep->segments_.size()));
+    PLAYLISTSTATE &state(m_playlistStates[rep]);
+    bool blocking(state.m_canBlockReload);
+    std::chrono::milliseconds backOff(m_segmentIntervalSec * 500);
+    std::chrono::steady_clock::time_point giveUp(std::chrono::steady_clock::now() + std::chrono::seconds(3 * m_segmentIntervalSec));
 
-    while (prepareRepresentation(rep, true) && retryCount > 0)
+    while (std::chrono::steady_clock::now() < giveUp)
     {
-      if (rep->segments_.pos(seg) + 1 == rep->segments_.data.size())
+      // With partial segments the next segment shows up with its first part
+      if (!LoadPlaylist(rep, true, lck, blocking ? nextSegment : ~0U, state.m_partTarget > 0.0 ? 0 : ~0U))
       {
-        //Look if we have a new segment
-        if (rep->newStartNumber_ + rep->newSegments_.data.size() > rep->startNumber_ + rep->segments_.data.size())
+        if (!blocking)
           break;
-        for (unsigned int i(0); i < 20; ++i)
-        {
-          std::this_thread::sleep_for(std::chrono::milliseconds(100));
-          if (!(rep->flags_ & Representation::ENABLED))
-            return;
-        }
+        // Server did not accept the blocking request, fall back to polling
+        blocking = false;
+        continue;
       }
-      else
+      if ((~rep->newStartNumber_ && rep->newStartNumber_ + rep->newSegments_.size() > nextSegment) || !(rep->flags_ & Representation::ENABLED))
         break;
-      retryCount -= 2;
+
+      // Unchanged playlist: wait half a target duration first, then back off up to one target duration.
+      // This applies to blocking reloads too, a server may answer them early without the segment
+      lck.unlock();
+      for (std::chrono::milliseconds waited(0); waited < backOff; waited += std::chrono::milliseconds(100))
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (!(rep->flags_ & Representation::ENABLED))
+          return;
+      }
+      lck.lock();
+      backOff = std::min(backOff * 3 / 2, std::chrono::milliseconds(m_segmentIntervalSec * 1000));
     }
   }
 }
+
+bool HLSTree::GetSegmentPart(const Representation *rep, const Segment *seg, unsigned int part, std::string &url)
+{
+  // Reloads and the prefetch thread change the segment index, resolve our position under the lock
+  std::unique_lock<std::mutex> lck(m_treeMutex);
+  const SPINCACHE<Segment> &segments(rep->segments_);
+  if (!~segments.data.index(seg))
+    return false;
+
+  unsigned int msn(rep->startNumber_ + segments.pos(seg));
+  PLAYLISTSTATE &state(m_playlistStates[rep]);
+
+  // Segments already complete when we started are fetched as a whole
+  if (!part && state.m_incompleteMsn != msn)
+    return false;
+
+  // Poll every half part target, without PART-INF every half target duration
+  std::chrono::milliseconds backOff(state.m_partTarget > 0.0
+    ? static_cast<int>(state.m_partTarget * 500) : m_segmentIntervalSec * 500);
+  if (backOff < std::chrono::milliseconds(MIN_PART_RELOAD_MS))
+    backOff = std::chrono::milliseconds(MIN_PART_RELOAD_MS);
+  std::chrono::steady_clock::time_point giveUp(std::chrono::steady_clock::now() + std::chrono::seconds(3 * m_segmentIntervalSec));
+  bool reloaded(false);
+
+  while (rep->flags_ & Representation::ENABLED)
+  {
+    std::map<unsigned int, std::vector<std::string> >::const_iterator parts(state.m_parts.find(msn));
+    if (parts == state.m_parts.end())
+      return false;
+    if (part < parts->second.size())
+    {
+      url = parts->second[part];
+      return true;
+    }
+    // All parts of a completed segment delivered
+    if (state.m_incompleteMsn != msn || std::chrono::steady_clock::now() >= giveUp)
+      return false;
+
+    // A blocking reload returns once the part exists, only an early answer makes us wait
+    if (!state.m_canBlockReload || reloaded)
+    {
+      lck.unlock();
+      std::this_thread::sleep_for(backOff);
+      lck.lock();
+    }
+    if (!LoadPlaylist(const_cast<Representation*>(rep), true, lck, msn, part))
+      return false;
+    reloaded = true;
+  }
+  return false;
+}
@@ -21,6 +21,12 @@
 #include "../common/AdaptiveTree.h"
 #include <sstream>
 #include <map>
+#include <list>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 class AESDecrypter;
 
@@ -30,16 +36,26 @@ namespace adaptive
   class HLSTree : public AdaptiveTree
   {
   public:
-    HLSTree(AESDecrypter *decrypter) : AdaptiveTree(), m_decrypter(decrypter) {};
+    HLSTree(AESDecrypter *decrypter, bool prefetchPlaylists = false) : AdaptiveTree(), m_decrypter(decrypter), m_prefetchPlaylists(prefetchPlaylists) {};
     virtual ~HLSTree();
 
     virtual bool open(const std::string &url, const std::string &manifestUpdateParam) override;
     virtual bool prepareRepresentation(Representation *rep, bool update = false) override;
-    virtual bool write_data(void *buffer, size_t buffer_size) override;
+    virtual bool write_data(void *buffer, size_t buffer_size, void *opaque) override;
     virtual void OnDataArrived(Representation *rep, const Segment *seg, const uint8_t *src, uint8_t *dst, size_t dstOffset, size_t dataSize) override;
     virtual void RefreshSegments(Representation *rep, const Segment *seg) override;
+    virtual bool GetSegmentPart(const Representation *rep, const Segment *seg, unsigned int part, std::string &url) override;
+    virtual void SetRepresentationEnabled(Representation *rep, bool enabled) override;
   private:
     void ClearStream();
+    void FreeSegments(Representation *rep, SPINCACHE<Segment> &segments);
+    bool LoadPlaylist(Representation *rep, bool update, std::unique_lock<std::mutex> &lck, unsigned int blockingMsn = ~0U, unsigned int blockingPart = ~0U, std::stringstream *prefetched = nullptr);
+    void PrefetchWorker();
+    void RequestKey(const std::string &uri);
+    std::string GetKey(const std::string &uri);
+    bool DownloadKey(const std::string &uri, std::string &key);
+    void StoreKey(const std::string &uri, const std::string &key);
+    void KeyWorker();
     std::stringstream m_stream;
     std::string m_audioCodec;
 
@@ -60,10 +76,41 @@ namespace adaptive
     };
 
     std::map<std::string, EXTGROUP> m_extGroups;
+
+    // Per media playlist state needed for live reloads
+    struct PLAYLISTSTATE
+    {
+      double m_canSkipUntil = 0.0; //EXT-X-SERVER-CONTROL, 0 if delta updates are not supported
+      bool m_canBlockReload = false;
+      double m_partTarget = 0.0; //EXT-X-PART-INF, 0 if the playlist has no partial segments
+      std::map<unsigned int, std::vector<std::string> > m_parts; //part urls by media sequence number
+      unsigned int m_incompleteMsn = ~0U; //last segment, only available as parts yet
+      std::chrono::steady_clock::time_point m_loaded;
+    };
+    std::map<const Representation*, PLAYLISTSTATE> m_playlistStates;
     bool m_refreshPlayList = true;
-    uint8_t m_segmentIntervalSec = 4;
+    uint32_t m_segmentIntervalSec = 4; //EXT-X-TARGETDURATION, never 0
     AESDecrypter *m_decrypter;
     uint8_t m_iv[16];
+
+    // Background prefetch of not yet enabled media playlists
+    bool m_prefetchPlaylists;
+    bool m_prefetchStop = false;
+    std::thread m_prefetchThread;
+    std::condition_variable m_prefetchSignal;
+    std::map<const Representation*, std::chrono::steady_clock::time_point> m_prefetched;
+    // Guards m_stream and the playlist data shared with the prefetch thread
+    std::mutex m_treeMutex;
+
+    // AES-128 keys by URI, most recently used first. Keys are requested
+    // while parsing playlists and fetched ahead by the key thread.
+    std::list<std::pair<std::string, std::string> > m_keys;
+    std::deque<std::string> m_keyQueue;
+    std::string m_keyLoading; //URI the key thread currently downloads
+    bool m_keyStop = false;
+    std::thread m_keyThread;
+    std::condition_variable m_keySignal, m_keyLoaded;
+    std::mutex m_keyMutex;
   };
 
 } // namespace
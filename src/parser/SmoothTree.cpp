@@ -21,14 +21,20 @@
 #include <fstream>
 #include <float.h>
 #include <algorithm>
+#include <thread>
 
 #include "SmoothTree.h"
 #include "../oscompat.h"
 #include "../helpers.h"
+#include "../log.h"
 
 using namespace adaptive;
 
+// Refill the live timeline from the manifest when fewer segments are left
+static const uint32_t REFILL_SEGMENTS_LEFT = 3;
+
 SmoothTree::SmoothTree()
+  : is_update_(false)
 {
   current_period_ = new AdaptiveTree::Period;
   periods_.push_back(current_period_);
@@ -217,17 +223,22 @@ start(void *data, const char *el, const char **attr)
   }
   else if (strcmp(el, "SmoothStreamingMedia") == 0)
   {
-    uint64_t timeScale = 0, duration = 0;
+    uint64_t timeScale = 0, duration = 0, dvrWindow = 0;
     dash->overallSeconds_ = 0;
+    // IsLive defaults to FALSE
+    dash->is_static_ = true;
     for (; *attr;)
     {
       if (strcmp((const char*)*attr, "TimeScale") == 0)
         timeScale = atoll((const char*)*(attr + 1));
       else if (strcmp((const char*)*attr, "Duration") == 0)
         duration = atoll((const char*)*(attr + 1));
+      else if (strcmp((const char*)*attr, "DVRWindowLength") == 0)
+        dvrWindow = atoll((const char*)*(attr + 1));
       else if (strcmp((const char*)*attr, "IsLive") == 0)
       {
         dash->has_timeshift_buffer_ = strcmp((const char*)*(attr + 1), "TRUE") == 0;
+        dash->is_static_ = !dash->has_timeshift_buffer_;
         if (dash->has_timeshift_buffer_)
         {
           dash->stream_start_ = time(0);
@@ -237,7 +248,11 @@ start(void *data, const char *el, const char **attr)
       attr += 2;
     }
     if (timeScale)
+    {
       dash->overallSeconds_ = duration / timeScale;
+      if (dash->has_timeshift_buffer_)
+        dash->timeshift_buffer_depth_ = static_cast<uint32_t>(dvrWindow / timeScale);
+    }
     dash->currentNode_ |= SmoothTree::SSMNODE_SSM;
     dash->minPresentationOffset = ~0ULL;
     dash->base_time_ = ~0ULL;
@@ -361,7 +376,12 @@ bool SmoothTree::open(const std::string &url, const std::string &manifestUpdateP
   currentNode_ = 0;
   strXMLText_.clear();
 
-  bool ret = download(manifest_url_.c_str(), manifest_headers_);
+  // An unchanged manifest is answered with 304, leaving this tree empty.
+  // On first open a 304 confirms the snapshot of a previous session.
+  std::string snapshot;
+  bool useSnapshot(!is_update_ && ReadSnapshot(snapshot));
+  bool notModified(false);
+  bool ret = download(manifest_url_.c_str(), manifest_headers_, nullptr, (is_update_ || !snapshot_path_.empty()) ? &notModified : nullptr);
 
   XML_ParserFree(parser_);
   parser_ = 0;
@@ -369,6 +389,16 @@ bool SmoothTree::open(const std::string &url, const std::string &manifestUpdateP
   if (!ret)
     return false;
 
+  if (useSnapshot && notModified)
+  {
+    // Invalid snapshots are removed, parse the manifest again
+    if (LoadSnapshot(snapshot))
+      return true;
+    refresh_state_.validators_.erase(manifest_url_);
+    periods_.push_back(current_period_ = new AdaptiveTree::Period);
+    return open(url, manifestUpdateParam);
+  }
+
   uint8_t psshset(0);
 
   if (!current_defaultKID_.empty())
@@ -379,10 +409,10 @@ bool SmoothTree::open(const std::string &url, const std::string &manifestUpdateP
     for (std::vector<SmoothTree::Representation*>::iterator b((*ba)->repesentations_.begin()), e((*ba)->repesentations_.end()); b != e; ++b)
     {
       (*b)->segments_.data.resize((*ba)->segment_durations_.data.size());
-      std::vector<uint32_t>::iterator bsd((*ba)->segment_durations_.data.begin());
+      STABLEVECTOR<uint32_t>::iterator bsd((*ba)->segment_durations_.data.begin());
       uint64_t cummulated((*ba)->startPTS_ - base_time_), index(1);
 
-      for (std::vector<SmoothTree::Segment>::iterator bs((*b)->segments_.data.begin()), es((*b)->segments_.data.end()); bs != es; ++bsd, ++bs, ++index)
+      for (STABLEVECTOR<SmoothTree::Segment>::iterator bs((*b)->segments_.data.begin()), es((*b)->segments_.data.end()); bs != es; ++bsd, ++bs, ++index)
       {
         bs->startPTS_ = cummulated;
         bs->range_begin_ = cummulated + base_time_;
@@ -395,10 +425,13 @@ bool SmoothTree::open(const std::string &url, const std::string &manifestUpdateP
 
   SortTree();
 
+  if (!is_update_)
+    SaveSnapshot();
+
   return true;
 }
 
-bool SmoothTree::write_data(void *buffer, size_t buffer_size)
+bool SmoothTree::write_data(void *buffer, size_t buffer_size, void *opaque)
 {
   bool done(false);
   XML_Status retval = XML_Parse(parser_, (const char*)buffer, buffer_size, done);
@@ -408,6 +441,101 @@ bool SmoothTree::write_data(void *buffer, size_t buffer_size)
   return true;
 }
 
+void SmoothTree::RefreshSegments(Representation *rep, const Segment *seg)
+{
+  if (!has_timeshift_buffer_ || rep->segments_.empty())
+    return;
+
+  // tfrf lookahead boxes usually keep the timeline filled
+  uint32_t segPos(rep->get_segment_pos(seg));
+  if (~segPos && segPos + REFILL_SEGMENTS_LEFT < rep->segments_.size())
+    return;
+
+  AdaptationSet *adp(nullptr);
+  for (std::vector<AdaptationSet*>::const_iterator ba(current_period_->adaptationSets_.begin()), ea(current_period_->adaptationSets_.end()); ba != ea && !adp; ++ba)
+    if (std::find((*ba)->repesentations_.begin(), (*ba)->repesentations_.end(), rep) != (*ba)->repesentations_.end())
+      adp = *ba;
+  if (!adp || adp->segment_durations_.empty())
+    return;
+
+  // At the live edge we wait for the next fragment up to 3 fragment durations
+  uint64_t fragmentMs(static_cast<uint64_t>(*adp->segment_durations_[static_cast<uint32_t>(adp->segment_durations_.size() - 1)]) * 1000 / adp->timescale_);
+  std::chrono::steady_clock::time_point giveUp(std::chrono::steady_clock::now() + std::chrono::milliseconds(3 * fragmentMs));
+  while (!RefillSegments(adp, ~segPos ? segPos : 0) && ~segPos && segPos + 1 >= rep->segments_.size()
+    && std::chrono::steady_clock::now() < giveUp)
+  {
+    for (uint64_t waited(0); waited < fragmentMs / 2; waited += 100)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (!(rep->flags_ & Representation::ENABLED))
+        return;
+    }
+  }
+}
+
+bool SmoothTree::RefillSegments(AdaptationSet *adp, uint32_t segPos)
+{
+  std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+  if (!update_tree_ || now - last_update_time_ >= std::chrono::seconds(1))
+  {
+    last_update_time_ = now;
+    std::unique_ptr<SmoothTree> updateTree(new SmoothTree());
+    updateTree->is_update_ = true;
+    updateTree->manifest_headers_ = manifest_headers_;
+    std::swap(updateTree->refresh_state_, refresh_state_);
+    bool updated(updateTree->open(manifest_url_, ""));
+    std::swap(updateTree->refresh_state_, refresh_state_);
+    // Keep the previous manifest on 304, it is still current
+    if (updated && !updateTree->current_period_->adaptationSets_.empty())
+      update_tree_.swap(updateTree);
+  }
+  if (!update_tree_)
+    return false;
+
+  const AdaptationSet *upd(nullptr);
+  for (std::vector<AdaptationSet*>::const_iterator ba(update_tree_->current_period_->adaptationSets_.begin()), ea(update_tree_->current_period_->adaptationSets_.end()); ba != ea && !upd; ++ba)
+    if ((*ba)->base_url_ == adp->base_url_)
+      upd = *ba;
+  if (!upd)
+    return false;
+
+  // Append all fragments following the last one we know in a single step
+  std::lock_guard<std::mutex> lck(m_segmentMutex);
+  Representation *ref(adp->repesentations_[0]);
+  uint64_t lastTime(ref->segments_[static_cast<uint32_t>(ref->segments_.size() - 1)]->range_begin_), fragmentTime(upd->startPTS_);
+  size_t appended(0);
+  for (STABLEVECTOR<uint32_t>::const_iterator bd(upd->segment_durations_.data.begin()), ed(upd->segment_durations_.data.end()); bd != ed; fragmentTime += *bd++)
+  {
+    if (fragmentTime <= lastTime)
+      continue;
+    if (!appended)
+      adp->segment_durations_.data.back() = static_cast<uint32_t>(fragmentTime - lastTime);
+    adp->segment_durations_.append(*bd);
+    for (std::vector<Representation*>::iterator b(adp->repesentations_.begin()), e(adp->repesentations_.end()); b != e; ++b)
+    {
+      Segment seg(*(*b)->segments_[static_cast<uint32_t>((*b)->segments_.size() - 1)]);
+      seg.startPTS_ = fragmentTime - base_time_;
+      seg.range_begin_ = fragmentTime;
+      ++seg.range_end_;
+      (*b)->segments_.append(seg);
+    }
+    ++appended;
+  }
+  if (!appended)
+    return false;
+
+  Log(LOGLEVEL_DEBUG, "Smooth refill: %u fragments appended to %s", static_cast<unsigned int>(appended), adp->base_url_.c_str());
+
+  size_t expired(GetExpiredSegments(ref, segPos, appended));
+  if (expired)
+  {
+    for (std::vector<Representation*>::iterator b(adp->repesentations_.begin()), e(adp->repesentations_.end()); b != e; ++b)
+      TrimSegments(*b, expired);
+    adp->segment_durations_.trim(expired);
+  }
+  return true;
+}
+
 void SmoothTree::parse_protection()
 {
   if (strXMLText_.empty())
@@ -19,6 +19,8 @@
 #pragma once
 
 #include "../common/AdaptiveTree.h"
+#include <chrono>
+#include <memory>
 
 namespace adaptive
 {
@@ -28,7 +30,8 @@ namespace adaptive
   public:
     SmoothTree();
     virtual bool open(const std::string &url, const std::string &manifestUpdateParam) override;
-    virtual bool write_data(void *buffer, size_t buffer_size) override;
+    virtual bool write_data(void *buffer, size_t buffer_size, void *opaque) override;
+    virtual void RefreshSegments(Representation *rep, const Segment *seg) override;
 
     void parse_protection();
 
@@ -42,6 +45,13 @@ namespace adaptive
     };
 
     uint64_t pts_helper_;
+    bool is_update_; //manifest reloaded to refill the live timeline
+
+  private:
+    bool RefillSegments(AdaptationSet *adp, uint32_t segPos);
+
+    std::chrono::steady_clock::time_point last_update_time_;
+    std::unique_ptr<SmoothTree> update_tree_;
   };
 
 }